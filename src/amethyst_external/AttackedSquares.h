@@ -6,7 +6,7 @@
 #define AMETHYST_CHESS_ATTACKEDSQUARES_H
 #include "RankFileBitmasks.h"
 
-unsigned long getKingAttackedSquares (const int square) {
+constexpr unsigned long getKingAttackedSquares (const int square) {
     const int rank = square % 8;
     const int file = square / 8;
 
@@ -25,7 +25,7 @@ unsigned long getKingAttackedSquares (const int square) {
     return attackedSquares;
 }
 
-unsigned long getKnightAttackedSquares (const int square) {
+constexpr unsigned long getKnightAttackedSquares (const int square) {
     const unsigned long startSquare = 1ULL << square;
     const int rank = square % 8;
     const int file = square / 8;
@@ -68,14 +68,14 @@ unsigned long getKnightAttackedSquares (const int square) {
     return attackedSquares;
 }
 
-unsigned long getRookAttackedSquares (const int square) {
+constexpr unsigned long getRookAttackedSquares (const int square) {
     const int rank = square % 8;
     const int file = square / 8;
 
     return (A_FILE << (file * 8) | FIRST_RANK << rank) - (1ULL << square);
 }
 
-unsigned long getBishopAttackedSquares (const int square) {
+constexpr unsigned long getBishopAttackedSquares (const int square) {
     const int rank = square % 8;
     const int file = square / 8;
 
@@ -96,11 +96,11 @@ unsigned long getBishopAttackedSquares (const int square) {
     return attackedSquares;
 }
 
-unsigned long getQueenAttackedSquares (const int square) {
+constexpr unsigned long getQueenAttackedSquares (const int square) {
     return getRookAttackedSquares(square) | getBishopAttackedSquares(square);
 }
 
-unsigned long getRookPotentialBlockers (int square) {
+constexpr unsigned long getRookPotentialBlockers (int square) {
     const int rank = square % 8;
     const int file = square / 8;
 
@@ -110,11 +110,11 @@ unsigned long getRookPotentialBlockers (int square) {
     return (fileBlockers | rankBlockers) & ~(1ULL << square);
 }
 
-unsigned long getBishopPotentialBlockers (int square) {
+constexpr unsigned long getBishopPotentialBlockers (int square) {
     return getBishopAttackedSquares(square) & INNER_36;
 }
 
-unsigned long getBishopLegalMoves (int square, unsigned long blockers) {
+constexpr unsigned long getBishopLegalMoves (int square, unsigned long blockers) {
     //assert(((blockers & getBishopPotentialBlockers(square)) == blockers));
     blockers &= getBishopPotentialBlockers(square);
     const int rank = square % 8;
@@ -139,7 +139,7 @@ unsigned long getBishopLegalMoves (int square, unsigned long blockers) {
     return attackedSquares;
 }
 
-unsigned long getRookLegalMoves (int square, unsigned long blockers) {
+constexpr unsigned long getRookLegalMoves (int square, unsigned long blockers) {
     //assert(((blockers & getRookPotentialBlockers(square)) == blockers));
     blockers &= getRookPotentialBlockers(square);
     const int rank = square % 8;
@@ -167,7 +167,7 @@ unsigned long getRookLegalMoves (int square, unsigned long blockers) {
     return attackedSquares;
 }
 
-unsigned long getQueenLegalMoves (int square, unsigned long blockers) {
+constexpr unsigned long getQueenLegalMoves (int square, unsigned long blockers) {
     return getRookLegalMoves(square, blockers) | getBishopLegalMoves(square,blockers);
 }
 
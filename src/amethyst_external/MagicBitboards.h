@@ -4,123 +4,34 @@
 
 #ifndef AMETHYST_CHESS_MAGICBITBOARDS_H
 #define AMETHYST_CHESS_MAGICBITBOARDS_H
-#include <vector>
+#include <array>
+#include <cassert>
 #include "AttackedSquares.h"
-#include "BitLogarithm.h"
 #include "MagicNumbers.h"
 #include "Flags.h"
+#include "../engines/amethyst_config.h"
+#if defined(__BMI2__)
+#include <immintrin.h>
+#endif
 using namespace std;
 
-vector<unsigned long> getKingAttackedSquaresTable () {
-    vector<unsigned long> kingAttackedSquaresTable(64);
+constexpr array<unsigned long, 64> getKingAttackedSquaresTable () {
+    array<unsigned long, 64> kingAttackedSquaresTable{};
     for (int square = 0; square < 64; square++) {
         kingAttackedSquaresTable[square] = getKingAttackedSquares(square);
     }
     return kingAttackedSquaresTable;
 }
 
-vector<unsigned long> getKnightAttackedSquaresTable () {
-    vector<unsigned long> knightAttackedSquaresTable(64);
+constexpr array<unsigned long, 64> getKnightAttackedSquaresTable () {
+    array<unsigned long, 64> knightAttackedSquaresTable{};
     for (int square = 0; square < 64; square++) {
         knightAttackedSquaresTable[square] = getKnightAttackedSquares(square);
     }
     return knightAttackedSquaresTable;
 }
 
-vector<unsigned long> getAllSubBitsOf (unsigned long original) {
-    // This function has been bug tested and is correct
-    // Having good variable names for this function is almost impossible because literator just has so many things that mean different things.
-    // Step 1: Find the 1 bits
-    int bitCount = 0;
-    vector<int> oneBits;
-    for (int i = 0; i < 64; i++) {
-        if (((original >> i) & 1ULL) == 1ULL) {
-            bitCount++;
-            oneBits.push_back(i);
-        }
-    }
-    unsigned long remainingBits = original;
-    int index = 0;
-    while (remainingBits != 0ULL) {
-        int smallestOneBit = LOG_2_TABLE.get(remainingBits & -remainingBits);
-        oneBits[index] = smallestOneBit;
-        index++;
-        remainingBits -= 1L << smallestOneBit;
-    }
-
-    // Step 2: Construct all possibilities
-    vector<unsigned long> possibilities(1 << bitCount);
-    for (index = 0; index < possibilities.size(); index++) {
-        // For every 1 bit in index, OR the thing from oneBits
-        unsigned long subBits = 0ULL;
-        for (int bit = 0; bit < bitCount; bit++) {
-            if (((index >> bit) & 1) == 1)
-                subBits |= 1L << oneBits[bit];
-        } // end inner for loop
-        possibilities[index] = subBits;
-    } // end outer for loop
-    return possibilities;
-} // end getAllSubBitsOf
-
-int bitCount (const unsigned long number) {
-    int bitCount = 0;
-    for (int i = 0; i < 64; i++) {
-        if (((number >> i) & 1ULL) == 1ULL) {
-            bitCount++;
-        }
-    }
-    return bitCount;
-}
-
-vector<unsigned long> getRookMagicBitboardTable(int startSquare, unsigned long magicNumber, int numBits) {
-    //unsigned long numBits = bitCount(getRookPotentialBlockers(startSquare));
-    vector<unsigned long> magicBitboardTable(1 << numBits);
-
-    for (unsigned long blockersMask : getAllSubBitsOf(getRookPotentialBlockers(startSquare))) {
-        unsigned long result = getRookLegalMoves(startSquare,blockersMask);
-        unsigned long bucket = (blockersMask * magicNumber) >> (64 - numBits);
-        assert(magicBitboardTable[bucket] == 0ULL or magicBitboardTable[bucket] == result);
-        magicBitboardTable[bucket] = result;
-    }
-
-    return magicBitboardTable;
-}
-
-vector<unsigned long> getBishopMagicBitboardTable(int startSquare, unsigned long magicNumber, int numBits) {
-    vector<unsigned long> magicBitboardTable(1 << numBits);
-
-    for (unsigned long blockersMask : getAllSubBitsOf(getBishopPotentialBlockers(startSquare))) {
-        unsigned long result = getBishopLegalMoves(startSquare,blockersMask);
-        unsigned long bucket = (blockersMask * magicNumber) >> (64 - numBits);
-        assert(magicBitboardTable[bucket] == 0ULL or magicBitboardTable[bucket] == result);
-        magicBitboardTable[bucket] = result;
-    }
-
-    return magicBitboardTable;
-}
-
-// A 2D vector is not the fastest way to do this, but I will optimize literator later.
-vector<vector<unsigned long>> getRookMagicBitboardTable() {
-    vector<vector<unsigned long>> table(64);
-    for (int square = 0; square < 64; square++) {
-        int bits = rook_rellevant_bits[square];
-        unsigned long magic = rook_magics[square];
-        table[square] = getRookMagicBitboardTable(square,magic,bits);
-    }
-    return table;
-}
-
-vector<vector<unsigned long>> getBishopMagicBitboardTable() {
-    vector<vector<unsigned long>> table(64);
-    for (int square = 0; square < 64; square++) {
-        int bits = bishop_rellevant_bits[square];
-        unsigned long magic = bishop_magics[square];
-        table[square] = getBishopMagicBitboardTable(square,magic,bits);
-    }
-    return table;
-}
-
-const unsigned long ROOK_RELEVANT_BLOCKERS[64] = {282578800148862,
+constexpr const static unsigned long ROOK_RELEVANT_BLOCKERS[64] = {282578800148862,
                                                         565157600297596,
                                                         1130315200595066,
                                                         2260630401190006,
@@ -185,7 +96,7 @@ const unsigned long ROOK_RELEVANT_BLOCKERS[64] = {282578800148862,
                                                         4485655873561051136,
                                                         9115426935197958144};
 
-const unsigned long BISHOP_RELEVANT_BLOCKERS[64] = {18049651735527936,
+constexpr const static unsigned long BISHOP_RELEVANT_BLOCKERS[64] = {18049651735527936,
 70506452091904,
 275415828992,
 1075975168,
@@ -250,10 +161,85 @@ const unsigned long BISHOP_RELEVANT_BLOCKERS[64] = {18049651735527936,
 9024825867763712,
 18049651735527936};
 
-const vector<vector<unsigned long>> ROOK_MAGIC_BITBOARD_TABLE = getRookMagicBitboardTable();
-const vector<vector<unsigned long>> BISHOP_MAGIC_BITBOARD_TABLE = getBishopMagicBitboardTable();
-const vector<unsigned long> KING_ATTACKED_SQUARES_TABLE = getKingAttackedSquaresTable();
-const vector<unsigned long> KNIGHT_ATTACKED_SQUARES_TABLE = getKnightAttackedSquaresTable();
+constexpr const static array<unsigned long, 64> KING_ATTACKED_SQUARES_TABLE = getKingAttackedSquaresTable();
+constexpr const static array<unsigned long, 64> KNIGHT_ATTACKED_SQUARES_TABLE = getKnightAttackedSquaresTable();
+
+// Everything a slider lookup needs for one square, packed into 32 bytes so it is a single cache line access
+struct SliderMagic {
+    unsigned long* attacks; // This square's block of SLIDER_ATTACKS_TABLE
+    unsigned long relevantBlockers;
+    unsigned long magic;
+    int shift;
+};
+
+// Every square gets a block of 2^(relevant blockers) entries. That is what PEXT indexes,
+// and the N-1 rook magics index the first half of it.
+constexpr int getSliderAttacksTableSize () {
+    int size = 0;
+    for (int square = 0; square < 64; square++) {
+        size += 1 << __builtin_popcountll(ROOK_RELEVANT_BLOCKERS[square]);
+        size += 1 << __builtin_popcountll(BISHOP_RELEVANT_BLOCKERS[square]);
+    }
+    return size;
+}
+
+constexpr const static int SLIDER_ATTACKS_TABLE_SIZE = getSliderAttacksTableSize();
+
+// Rook and bishop attacks for all squares in one flat table, instead of a vector per square
+alignas(64) static unsigned long SLIDER_ATTACKS_TABLE[SLIDER_ATTACKS_TABLE_SIZE];
+alignas(64) static SliderMagic ROOK_MAGICS[64];
+alignas(64) static SliderMagic BISHOP_MAGICS[64];
+
+// PEXT is only used when the build targets BMI2. Dispatching at runtime costs a branch per lookup,
+// and measured slower than the magics.
+#if defined(__BMI2__)
+constexpr const static bool USE_PEXT_ATTACKS = usePextAttacks;
+#else
+constexpr const static bool USE_PEXT_ATTACKS = false;
+#endif
+
+inline unsigned long getSliderAttacksIndex (const SliderMagic &sliderMagic, const unsigned long allPieces) {
+#if defined(__BMI2__)
+    if constexpr (USE_PEXT_ATTACKS)
+        return _pext_u64(allPieces, sliderMagic.relevantBlockers);
+#endif
+    return ((allPieces & sliderMagic.relevantBlockers) * sliderMagic.magic) >> sliderMagic.shift;
+}
+
+template<bool isRook>
+unsigned long* fillSliderMagics (SliderMagic* sliderMagics, unsigned long* attacks) {
+    for (int square = 0; square < 64; square++) {
+        SliderMagic &sliderMagic = sliderMagics[square];
+        sliderMagic.attacks = attacks;
+        sliderMagic.relevantBlockers = isRook ? ROOK_RELEVANT_BLOCKERS[square] : BISHOP_RELEVANT_BLOCKERS[square];
+        sliderMagic.magic = isRook ? rook_magics[square] : bishop_magics[square];
+        sliderMagic.shift = isRook ? rook_shifts[square] : bishop_shifts[square];
+
+        // Walks every subset of the relevant blockers in increasing PEXT index order
+        unsigned long blockersMask = 0ULL;
+        unsigned long pextIndex = 0;
+        do {
+            const unsigned long result = isRook ? getRookLegalMoves(square, blockersMask) : getBishopLegalMoves(square, blockersMask);
+            const unsigned long bucket = USE_PEXT_ATTACKS ? pextIndex : getSliderAttacksIndex(sliderMagic, blockersMask);
+            assert(attacks[bucket] == 0ULL or attacks[bucket] == result);
+            attacks[bucket] = result;
+            blockersMask = (blockersMask - sliderMagic.relevantBlockers) & sliderMagic.relevantBlockers;
+            pextIndex++;
+        } while (blockersMask != 0ULL);
+
+        attacks += pextIndex;
+    }
+    return attacks;
+}
+
+bool fillSliderAttacksTable () {
+    unsigned long* attacks = fillSliderMagics<true>(ROOK_MAGICS, SLIDER_ATTACKS_TABLE);
+    attacks = fillSliderMagics<false>(BISHOP_MAGICS, attacks);
+    assert(attacks == SLIDER_ATTACKS_TABLE + SLIDER_ATTACKS_TABLE_SIZE);
+    return true;
+}
+
+const static bool SLIDER_ATTACKS_TABLE_FILLED = fillSliderAttacksTable();
 
 
 // TODONE: Inline these functions at the very end of the project.
@@ -267,14 +253,14 @@ inline unsigned long getMagicKnightAttackedSquares(const int startingSquare) {
     return KNIGHT_ATTACKED_SQUARES_TABLE[startingSquare];
 }
 
-inline unsigned long getMagicBishopAttackedSquares (const int startingSquare, unsigned long allPieces) {
-    allPieces &= BISHOP_RELEVANT_BLOCKERS[startingSquare];
-    return BISHOP_MAGIC_BITBOARD_TABLE[startingSquare][(allPieces * bishop_magics[startingSquare]) >> bishop_shifts[startingSquare]];
+inline unsigned long getMagicBishopAttackedSquares (const int startingSquare, const unsigned long allPieces) {
+    const SliderMagic &sliderMagic = BISHOP_MAGICS[startingSquare];
+    return sliderMagic.attacks[getSliderAttacksIndex(sliderMagic, allPieces)];
 }
 
-inline unsigned long getMagicRookAttackedSquares (const int startingSquare, unsigned long allPieces) {
-    allPieces &= ROOK_RELEVANT_BLOCKERS[startingSquare];
-    return ROOK_MAGIC_BITBOARD_TABLE[startingSquare][(allPieces * rook_magics[startingSquare]) >> rook_shifts[startingSquare]];
+inline unsigned long getMagicRookAttackedSquares (const int startingSquare, const unsigned long allPieces) {
+    const SliderMagic &sliderMagic = ROOK_MAGICS[startingSquare];
+    return sliderMagic.attacks[getSliderAttacksIndex(sliderMagic, allPieces)];
 }
 
 inline unsigned long getMagicQueenAttackedSquares (const int startingSquare, const unsigned long allPieces) {
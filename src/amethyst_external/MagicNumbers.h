@@ -12,8 +12,9 @@
 // Those are N-1 magics, so the magic numbers and relevant occupancy bits have been changed.
 // Those are copied from https://www.chessprogramming.org/Best_Magics_so_far
 
-// The rook magic bitboard tables take 713 KB of memory.
-// The bishop magic bitboard tables take 42 KB of memory.
+// The flat attack table in MagicBitboards.h gives every square 2^(relevant blockers) entries, so PEXT can index it too.
+// That takes 800 KiB for the rooks and 41 KiB for the bishops. The magics use the same layout, so they now take
+// 800 KiB for the rooks instead of 696 KiB (713 kB): the N-1 squares leave half of their block unused.
 
 // rook rellevant occupancy bits
 const static int rook_rellevant_bits[64] = {
@@ -805,6 +805,42 @@ private:
         updatePieceGivingCheck();
     }
 
+    ParameterChessBoard(const unsigned long (&whitePieces)[5], const unsigned long (&blackPieces)[5], const int whiteKing,
+                        const int blackKing, const bool whiteToMove, const bool whiteCastleShort, const bool whiteCastleLong,
+                        const bool blackCastleShort, const bool blackCastleLong, const int enPassantFile, const int halfmoves) {
+        halfmoveClock = halfmoves;
+
+        whiteKingPosition = whiteKing;
+        blackKingPosition = blackKing;
+        allWhitePieces = 1ULL << whiteKingPosition;
+        allBlackPieces = 1ULL << blackKingPosition;
+        for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+            whitePieceTypes[pieceType] = whitePieces[pieceType];
+            blackPieceTypes[pieceType] = blackPieces[pieceType];
+            allWhitePieces |= whitePieceTypes[pieceType];
+            allBlackPieces |= blackPieceTypes[pieceType];
+        }
+
+        isItWhiteToMove = whiteToMove;
+        canWhiteCastleShort = whiteCastleShort;
+        canWhiteCastleLong = whiteCastleLong;
+        canBlackCastleShort = blackCastleShort;
+        canBlackCastleLong = blackCastleLong;
+        whichPawnMovedTwoSquares = enPassantFile;
+        if (whichPawnMovedTwoSquares > 7)
+            whichPawnMovedTwoSquares = 255;
+
+        drawByInsufficientMaterial = false;
+        drawByStalemate = false;
+        whiteWonByCheckmate = false;
+        blackWonByCheckmate = false;
+        updatePieceGivingCheck();
+        updateMates();
+
+        updateDrawByInsufficientMaterial();
+        manuallyInitializeZobristCode();
+    }
+
     uint16_t getCaptureMove(int startSquare, int endSquare) const {
         if (isItWhiteToMove) {
             if (((blackPieceTypes[PAWN_CODE] >> endSquare) & 1ULL) == 1ULL)
@@ -889,6 +925,17 @@ public:
         return ParameterChessBoard(fenNotation);
     }
 
+    // Builds the board from bitboards that already use this class's square numbering (8 * file + rank), without going through a FEN.
+    // The pieces are indexed by piece code, and enPassantFile is the file of the en passant square or 255 if there is none.
+    static ParameterChessBoard boardFromBitboards(const unsigned long (&whitePieces)[5], const unsigned long (&blackPieces)[5],
+                                                  const int whiteKing, const int blackKing, const bool whiteToMove,
+                                                  const bool whiteCastleShort, const bool whiteCastleLong,
+                                                  const bool blackCastleShort, const bool blackCastleLong,
+                                                  const int enPassantFile, const int halfmoves) {
+        return ParameterChessBoard(whitePieces, blackPieces, whiteKing, blackKing, whiteToMove, whiteCastleShort,
+                                   whiteCastleLong, blackCastleShort, blackCastleLong, enPassantFile, halfmoves);
+    }
+
     string toFenNotation() const {
         string fenNotation;
         int numEmptySquares;
@@ -1214,7 +1261,7 @@ public:
             interposingSquares = lookupBishopCheckResponses(myKingPosition, thisPinningPieceSquare) -
                                  (1ULL << thisPinningPieceSquare);
             interposingOccupiedSquares = interposingSquares & allPieces;
-            if ((1ULL << FastLogarithm::log2(interposingOccupiedSquares)) == interposingOccupiedSquares)
+            if (FastLogarithm::isSingleBit(interposingOccupiedSquares))
                 bishopPinnedPieces |= interposingSquares;
             // In other words, if there is only one piece between the Bishop and the King, then it's pinned
             // And we might have caught an opponent's piece that could give a discovered attack if it were their turn, but that won't affect anything.
@@ -1226,7 +1273,7 @@ public:
             interposingSquares =
                     lookupRookCheckResponses(myKingPosition, thisPinningPieceSquare) - (1ULL << thisPinningPieceSquare);
             interposingOccupiedSquares = interposingSquares & allPieces;
-            if ((1ULL << FastLogarithm::log2(interposingOccupiedSquares)) == interposingOccupiedSquares)
+            if (FastLogarithm::isSingleBit(interposingOccupiedSquares))
                 rookPinnedPieces |= interposingSquares;
             // In other words, if there is only one piece between the Rook and the King, then it's pinned
             // And we might have caught an opponent's piece that could give a discovered attack if it were their turn, but that won't affect anything.
@@ -1401,7 +1448,7 @@ public:
             interposingSquares = lookupBishopCheckResponses(myKingPosition, thisPinningPieceSquare) -
                                  (1ULL << thisPinningPieceSquare);
             interposingOccupiedSquares = interposingSquares & allPieces;
-            if ((1ULL << FastLogarithm::log2(interposingOccupiedSquares)) == interposingOccupiedSquares)
+            if (FastLogarithm::isSingleBit(interposingOccupiedSquares))
                 bishopPinnedPieces |= interposingSquares;
             // In other words, if there is only one piece between the Bishop and the King, then it's pinned
             // And we might have caught an opponent's piece that could give a discovered attack if it were their turn, but that won't affect anything.
@@ -1413,7 +1460,7 @@ public:
             interposingSquares =
                     lookupRookCheckResponses(myKingPosition, thisPinningPieceSquare) - (1ULL << thisPinningPieceSquare);
             interposingOccupiedSquares = interposingSquares & allPieces;
-            if ((1ULL << FastLogarithm::log2(interposingOccupiedSquares)) == interposingOccupiedSquares)
+            if (FastLogarithm::isSingleBit(interposingOccupiedSquares))
                 rookPinnedPieces |= interposingSquares;
             // In other words, if there is only one piece between the Rook and the King, then it's pinned
             // And we might have caught an opponent's piece that could give a discovered attack if it were their turn, but that won't affect anything.
@@ -1830,7 +1877,7 @@ public:
                 startSquareMask = isItWhiteToMove ? getMagicBlackAttackedSquares(PAWN_CODE, endSquare, 0)
                                                   : getMagicWhiteAttackedSquares(PAWN_CODE, endSquare, 0);
                 startSquareMask &= A_FILE << (8 * (SAN[0] - 'a'));
-                startSquare = LOG_2_TABLE.get(startSquareMask);
+                startSquare = FastLogarithm::log2(startSquareMask);
                 assert(1ULL << startSquare == startSquareMask);
                 if (isItWhiteToMove)
                     isEnPassant = endSquare == whichPawnMovedTwoSquares * 8 + 5;
@@ -2414,7 +2461,7 @@ public:
             while (rooksRemaining != 0ULL) {
                 thisRookMask = rooksRemaining & -rooksRemaining;
                 rooksRemaining -= thisRookMask;
-                thisRookSquare = LOG_2_TABLE.get(thisRookMask);
+                thisRookSquare = FastLogarithm::log2(thisRookMask);
                 if ((whitePieceTypes[PAWN_CODE] & 255ULL << (thisRookSquare & 56)) == 0ULL)
                     rookOpenFileDiff++;
             }
@@ -2424,7 +2471,7 @@ public:
             while (rooksRemaining != 0ULL) {
                 thisRookMask = rooksRemaining & -rooksRemaining;
                 rooksRemaining -= thisRookMask;
-                thisRookSquare = LOG_2_TABLE.get(thisRookMask);
+                thisRookSquare = FastLogarithm::log2(thisRookMask);
                 if ((blackPieceTypes[PAWN_CODE] & 255ULL << (thisRookSquare & 56)) == 0ULL)
                     rookOpenFileDiff++;
             }
@@ -2494,6 +2541,157 @@ public:
         }
         return diffs;
     }
+
+    /**
+     * Sparse version of getCoefficients, calls trace.add(index, value) for the non-zero coefficients in ascending index order.
+     * Walks the set bits of the piece bitboards once: every pawn is classified once for all pawn structure terms,
+     * and the attacks of every piece are looked up once and shared by the mobility and king zone terms.
+     * Any new term has to be added here as well as in getCoefficients.
+     */
+    template<typename Trace>
+    void traceCoefficients(Trace& trace) const {
+        const unsigned long allPieces = allWhitePieces | allBlackPieces;
+
+        // Differences between white and black, filled by the passes over the pieces below
+        int mobilityDiffs[5] = {};
+        int kingZoneAttackDiffs[5] = {};
+        int heavisideKingZoneAttackDiffs[5] = {};
+        int passedPawnOnRankDiffs[8] = {};
+        int passedPawnOnFileDiffs[8] = {};
+        int passedPawnDiff = 0;
+        int protectedPassedPawnDiff = 0;
+        int doubledPawnDiff = 0;
+        int isolatedPawnDiff = 0;
+
+        if constexpr (includeMobility || includeKingZoneAttacks || includeHeavisideKingZoneAttacks) {
+            const unsigned long whiteKingZone = getMagicKingAttackedSquares(whiteKingPosition) | 1ULL << whiteKingPosition;
+            const unsigned long blackKingZone = getMagicKingAttackedSquares(blackKingPosition) | 1ULL << blackKingPosition;
+            for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+                for (unsigned long pieces = whitePieceTypes[pieceType]; pieces != 0ULL; pieces &= pieces - 1) {
+                    const unsigned long attacks = getMagicWhiteAttackedSquares(pieceType, __builtin_ctzll(pieces), allPieces);
+                    const int zoneAttacks = __builtin_popcountll(attacks & blackKingZone);
+                    mobilityDiffs[pieceType] += __builtin_popcountll(attacks & ~allWhitePieces);
+                    kingZoneAttackDiffs[pieceType] += zoneAttacks;
+                    heavisideKingZoneAttackDiffs[pieceType] += max(1, zoneAttacks);
+                }
+                for (unsigned long pieces = blackPieceTypes[pieceType]; pieces != 0ULL; pieces &= pieces - 1) {
+                    const unsigned long attacks = getMagicBlackAttackedSquares(pieceType, __builtin_ctzll(pieces), allPieces);
+                    const int zoneAttacks = __builtin_popcountll(attacks & whiteKingZone);
+                    mobilityDiffs[pieceType] -= __builtin_popcountll(attacks & ~allBlackPieces);
+                    kingZoneAttackDiffs[pieceType] -= zoneAttacks;
+                    heavisideKingZoneAttackDiffs[pieceType] -= max(1, zoneAttacks);
+                }
+            }
+        }
+
+        // Squares are 8 * file + rank, black ranks are flipped
+        for (unsigned long pawns = whitePieceTypes[PAWN_CODE]; pawns != 0ULL; pawns &= pawns - 1) {
+            const int square = __builtin_ctzll(pawns);
+            doubledPawnDiff += isThisWhitePawnDoubled(square);
+            isolatedPawnDiff += isThisWhitePawnIsolated(square);
+            if (isThisWhitePawnPassed(square)) {
+                passedPawnDiff++;
+                passedPawnOnRankDiffs[square & 7]++;
+                passedPawnOnFileDiffs[square >> 3]++;
+                if (getMagicBlackAttackedSquares(PAWN_CODE, square, 0) & whitePieceTypes[PAWN_CODE])
+                    protectedPassedPawnDiff++;
+            }
+        }
+        for (unsigned long pawns = blackPieceTypes[PAWN_CODE]; pawns != 0ULL; pawns &= pawns - 1) {
+            const int square = __builtin_ctzll(pawns);
+            doubledPawnDiff -= isThisBlackPawnDoubled(square);
+            isolatedPawnDiff -= isThisBlackPawnIsolated(square);
+            if (isThisBlackPawnPassed(square)) {
+                passedPawnDiff--;
+                passedPawnOnRankDiffs[(square & 7) ^ 7]--;
+                passedPawnOnFileDiffs[square >> 3]--;
+                if (getMagicWhiteAttackedSquares(PAWN_CODE, square, 0) & blackPieceTypes[PAWN_CODE])
+                    protectedPassedPawnDiff--;
+            }
+        }
+
+        int index = 0;
+        if constexpr (includeHeavisideKingZoneAttacks) {
+            for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+                trace.add(index++, heavisideKingZoneAttackDiffs[pieceType]);
+            }
+        }
+        if constexpr (includeRooksOpenFiles) {
+            // Black rooks on open files are added rather than subtracted, the same as in getCoefficients
+            int rookOpenFileDiff = 0;
+            for (unsigned long rooks = whitePieceTypes[ROOK_CODE]; rooks != 0ULL; rooks &= rooks - 1) {
+                if ((whitePieceTypes[PAWN_CODE] & 255ULL << (__builtin_ctzll(rooks) & 56)) == 0ULL)
+                    rookOpenFileDiff++;
+            }
+            for (unsigned long rooks = blackPieceTypes[ROOK_CODE]; rooks != 0ULL; rooks &= rooks - 1) {
+                if ((blackPieceTypes[PAWN_CODE] & 255ULL << (__builtin_ctzll(rooks) & 56)) == 0ULL)
+                    rookOpenFileDiff++;
+            }
+            trace.add(index++, rookOpenFileDiff);
+        }
+        if constexpr (includeBishopPair)
+            trace.add(index++, doesWhiteHaveBishopPair() - doesBlackHaveBishopPair());
+        if constexpr (includePassedPawnRanks) {
+            for (int rank = 0; rank < 8; rank++) {
+                trace.add(index++, passedPawnOnRankDiffs[rank]);
+            }
+        }
+        if constexpr (includePassedPawnFiles) {
+            for (int file = 0; file < 8; file++) {
+                trace.add(index++, passedPawnOnFileDiffs[file]);
+            }
+        }
+        if constexpr (includeProtectedPassedPawn)
+            trace.add(index++, protectedPassedPawnDiff);
+        if constexpr (includeWhiteToMove)
+            trace.add(index++, isItWhiteToMove ? 1 : -1);
+        if constexpr (includePassedPawn)
+            trace.add(index++, passedPawnDiff);
+        if constexpr (includeDoubledPawn)
+            trace.add(index++, doubledPawnDiff);
+        if constexpr (includeIsolatedPawn)
+            trace.add(index++, isolatedPawnDiff);
+        if constexpr (includeKingShelter)
+            trace.add(index++, getWhitePieceShieldCount() - getBlackPieceShieldCount());
+        if constexpr (includeKingZoneAttacks) {
+            for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+                trace.add(index++, kingZoneAttackDiffs[pieceType]);
+            }
+        }
+        if constexpr (includeMobility) {
+            for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+                trace.add(index++, mobilityDiffs[pieceType]);
+            }
+        }
+        if constexpr (includePSTs) {
+            // Black squares are mirrored, so a white and a black piece can cancel out on the same table entry
+            const unsigned long whiteKing = whiteKingPosition < 64 ? 1ULL << whiteKingPosition : 0ULL;
+            const unsigned long blackKing = blackKingPosition < 64 ? 1ULL << (blackKingPosition ^ 7) : 0ULL;
+            traceSquareDiffs(trace, index, whiteKing, blackKing);
+            index += 64;
+            for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+                traceSquareDiffs(trace, index, whitePieceTypes[pieceType], mirrorRanks(blackPieceTypes[pieceType]));
+                index += 64;
+            }
+        }
+    }
+
+private:
+    // Maps every square to square ^ 7, which flips the rank
+    static unsigned long mirrorRanks(unsigned long bitboard) {
+        bitboard = ((bitboard >> 1) & 0x5555555555555555ULL) | ((bitboard & 0x5555555555555555ULL) << 1);
+        bitboard = ((bitboard >> 2) & 0x3333333333333333ULL) | ((bitboard & 0x3333333333333333ULL) << 2);
+        bitboard = ((bitboard >> 4) & 0x0F0F0F0F0F0F0F0FULL) | ((bitboard & 0x0F0F0F0F0F0F0F0FULL) << 4);
+        return bitboard;
+    }
+
+    template<typename Trace>
+    static void traceSquareDiffs(Trace& trace, const int tableIndex, const unsigned long white, const unsigned long mirroredBlack) {
+        for (unsigned long squares = white ^ mirroredBlack; squares != 0ULL; squares &= squares - 1) {
+            const int square = __builtin_ctzll(squares);
+            trace.add(tableIndex + square, (white >> square & 1) ? 1 : -1);
+        }
+    }
 };
 
 #endif //AMETHYST_CHESS_PARAMETERCHESSBOARD_H
@@ -7,7 +7,16 @@
 
 #define TAPERED 1
 
+// Set to 1 to tune in single precision. Halves the size of parameters and gradients, at the cost of precision.
+#ifndef SINGLE_PRECISION
+#define SINGLE_PRECISION 0
+#endif
+
+#if SINGLE_PRECISION
+using tune_t = float;
+#else
 using tune_t = double;
+#endif
 
 #if TAPERED
 using pair_t = std::array<tune_t, 2>;
@@ -25,6 +34,36 @@ struct EvalResult
     tune_t endgame_scale = 1;
 };
 
+struct CoefficientEntry
+{
+    int16_t value;
+    int16_t index;
+};
+
+// Sparse alternative to EvalResult, the evaluation only appends its non-zero coefficients, in ascending index order.
+// The tuner hands every position of a thread the same trace, so appending stops allocating once the buffer has grown.
+struct SparseTrace
+{
+    std::vector<CoefficientEntry> coefficients;
+    tune_t score = 0;
+    tune_t endgame_scale = 1;
+
+    void add(const int32_t index, const int32_t value)
+    {
+        if (value != 0)
+        {
+            coefficients.push_back(CoefficientEntry{ static_cast<int16_t>(value), static_cast<int16_t>(index) });
+        }
+    }
+
+    void clear()
+    {
+        coefficients.clear();
+        score = 0;
+        endgame_scale = 1;
+    }
+};
+
 #if TAPERED
 enum class PhaseStages
 {
@@ -60,7 +99,7 @@ void get_initial_parameter_single(parameters_t& parameters, const T& parameter)
 #if TAPERED
     const auto mg = mg_score(static_cast<int32_t>(parameter));
     const auto eg = eg_score(static_cast<int32_t>(parameter));
-    const pair_t pair = { static_cast<double>(mg), static_cast<double>(eg) };
+    const pair_t pair = { static_cast<tune_t>(mg), static_cast<tune_t>(eg) };
     parameters.push_back(pair);
 #else
     parameters.push_back(static_cast<tune_t>(parameter));
@@ -0,0 +1,268 @@
+#include "checkpoint.h"
+
+#include <array>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <type_traits>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define CHECKPOINT_FSYNC 1
+#include <fcntl.h>
+#include <unistd.h>
+#else
+#define CHECKPOINT_FSYNC 0
+#endif
+
+using namespace std;
+using namespace Tuner;
+
+static constexpr array<char, 8> checkpoint_magic = { 'T', 'X', 'L', 'C', 'K', 'P', 'T', '1' };
+static constexpr uint32_t checkpoint_version = 3;
+static constexpr uint32_t max_checkpoint_name_length = 4096;
+
+struct CheckpointHeader
+{
+    array<char, 8> magic;
+    uint32_t version;
+    uint32_t value_size;
+    uint32_t tapered;
+    int32_t epoch;
+    uint64_t parameter_count;
+    uint64_t run_count;
+    uint64_t entry_count;
+    uint64_t total_weight;
+    int64_t batch_size;
+    uint64_t shuffle_seed;
+    uint64_t shuffle_share_count;
+};
+
+template<typename T>
+static void write_value(ofstream& file, const T& value)
+{
+    static_assert(is_trivially_copyable_v<T>);
+    file.write(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+static void read_value(ifstream& file, T& value)
+{
+    static_assert(is_trivially_copyable_v<T>);
+    file.read(reinterpret_cast<char*>(&value), sizeof(T));
+}
+
+static void write_parameters(ofstream& file, const parameters_t& parameters)
+{
+    file.write(reinterpret_cast<const char*>(parameters.data()), static_cast<streamsize>(parameters.size() * sizeof(parameters_t::value_type)));
+}
+
+static void read_parameters(ifstream& file, parameters_t& parameters, const uint64_t parameter_count)
+{
+    parameters.resize(parameter_count);
+    file.read(reinterpret_cast<char*>(parameters.data()), static_cast<streamsize>(parameter_count * sizeof(parameters_t::value_type)));
+}
+
+// Flushes the file to disk, so that after a power loss the renamed checkpoint is complete and not just its directory entry.
+// Without fsync on the platform this is left to the operating system.
+static bool sync_file([[maybe_unused]] const string& path)
+{
+#if CHECKPOINT_FSYNC
+    const int descriptor = open(path.c_str(), O_WRONLY);
+    if (descriptor < 0)
+    {
+        return false;
+    }
+    const bool synced = fsync(descriptor) == 0;
+    close(descriptor);
+    return synced;
+#else
+    return true;
+#endif
+}
+
+static bool save_checkpoint(const string& path, const Checkpoint& checkpoint)
+{
+    CheckpointHeader header{};
+    header.magic = checkpoint_magic;
+    header.version = checkpoint_version;
+    header.value_size = sizeof(tune_t);
+    header.tapered = TAPERED;
+    header.epoch = checkpoint.epoch;
+    header.parameter_count = checkpoint.runs.empty() ? 0 : checkpoint.runs[0].parameters.size();
+    header.run_count = checkpoint.runs.size();
+    header.entry_count = checkpoint.entry_count;
+    header.total_weight = checkpoint.total_weight;
+    header.batch_size = checkpoint.batch_size;
+    header.shuffle_seed = checkpoint.shuffle_seed;
+    header.shuffle_share_count = checkpoint.shuffle_share_count;
+
+    // Same as the dataset cache, a crash while writing leaves the previous checkpoint in place
+    const auto temp_path = path + ".tmp";
+    {
+        ofstream file(temp_path, ios::binary | ios::trunc);
+        if (!file)
+        {
+            return false;
+        }
+
+        write_value(file, header);
+        for (const auto& run : checkpoint.runs)
+        {
+            const auto name_length = static_cast<uint32_t>(run.config.name.size());
+            write_value(file, name_length);
+            file.write(run.config.name.data(), name_length);
+            write_value(file, run.config.initial_learning_rate);
+            write_value(file, run.config.learning_rate_drop_interval);
+            write_value(file, run.config.learning_rate_drop_ratio);
+            write_value(file, run.config.preferred_k);
+            write_value(file, run.config.max_epoch);
+            write_value(file, run.K);
+            write_value(file, run.learning_rate);
+            write_value(file, run.initial_error);
+            write_value(file, run.error);
+            write_value(file, run.epochs);
+            write_value(file, run.best_error);
+            write_value(file, run.best_epoch);
+            write_value(file, static_cast<uint8_t>(run.converged));
+            write_parameters(file, run.parameters);
+            write_parameters(file, run.momentum);
+            write_parameters(file, run.velocity);
+            write_parameters(file, run.best_parameters);
+        }
+
+        if (!file)
+        {
+            file.close();
+            remove(temp_path.c_str());
+            return false;
+        }
+    }
+
+    if (!sync_file(temp_path) || rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        remove(temp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+bool Tuner::load_checkpoint(const string& path, Checkpoint& checkpoint)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    CheckpointHeader header{};
+    read_value(file, header);
+    if (!file || header.magic != checkpoint_magic || header.version != checkpoint_version)
+    {
+        throw runtime_error("Checkpoint " + path + " is damaged or was written by another version of the tuner");
+    }
+    if (header.value_size != sizeof(tune_t) || header.tapered != TAPERED)
+    {
+        throw runtime_error("Checkpoint " + path + " was written with a different precision or tapering setting");
+    }
+
+    checkpoint.epoch = header.epoch;
+    checkpoint.entry_count = header.entry_count;
+    checkpoint.total_weight = header.total_weight;
+    checkpoint.batch_size = header.batch_size;
+    checkpoint.shuffle_seed = header.shuffle_seed;
+    checkpoint.shuffle_share_count = header.shuffle_share_count;
+    checkpoint.runs.resize(header.run_count);
+    for (auto& run : checkpoint.runs)
+    {
+        uint32_t name_length = 0;
+        read_value(file, name_length);
+        if (!file || name_length > max_checkpoint_name_length)
+        {
+            throw runtime_error("Checkpoint " + path + " is damaged");
+        }
+        run.config.name.resize(name_length);
+        file.read(run.config.name.data(), name_length);
+        read_value(file, run.config.initial_learning_rate);
+        read_value(file, run.config.learning_rate_drop_interval);
+        read_value(file, run.config.learning_rate_drop_ratio);
+        read_value(file, run.config.preferred_k);
+        read_value(file, run.config.max_epoch);
+        read_value(file, run.K);
+        read_value(file, run.learning_rate);
+        read_value(file, run.initial_error);
+        read_value(file, run.error);
+        read_value(file, run.epochs);
+        read_value(file, run.best_error);
+        read_value(file, run.best_epoch);
+        uint8_t converged = 0;
+        read_value(file, converged);
+        run.converged = converged != 0;
+        read_parameters(file, run.parameters, header.parameter_count);
+        read_parameters(file, run.momentum, header.parameter_count);
+        read_parameters(file, run.velocity, header.parameter_count);
+        read_parameters(file, run.best_parameters, header.parameter_count);
+    }
+
+    if (!file || file.peek() != char_traits<char>::eof())
+    {
+        throw runtime_error("Checkpoint " + path + " is damaged");
+    }
+    return true;
+}
+
+CheckpointWriter::CheckpointWriter(string path) : path(std::move(path))
+{
+    thread = std::thread([this]()
+    {
+        thread_loop();
+    });
+}
+
+CheckpointWriter::~CheckpointWriter()
+{
+    {
+        lock_guard lock(mutex);
+        should_stop = true;
+    }
+    condition.notify_one();
+    thread.join();
+}
+
+void CheckpointWriter::submit(Checkpoint& checkpoint)
+{
+    {
+        lock_guard lock(mutex);
+        swap(pending, checkpoint);
+        has_pending = true;
+    }
+    condition.notify_one();
+}
+
+void CheckpointWriter::thread_loop()
+{
+    Checkpoint writing;
+    while (true)
+    {
+        {
+            unique_lock lock(mutex);
+            condition.wait(lock, [this]
+            {
+                return has_pending || should_stop;
+            });
+
+            // The last submitted checkpoint is still written when stopping
+            if (!has_pending)
+            {
+                return;
+            }
+            swap(pending, writing);
+            has_pending = false;
+        }
+
+        if (!save_checkpoint(path, writing))
+        {
+            cout << "Unable to write checkpoint " << path << endl;
+        }
+    }
+}
@@ -0,0 +1,78 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H 1
+
+#include "base.h"
+#include "tuner.h"
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace Tuner
+{
+    // Adam state of a single run after an epoch
+    struct RunCheckpoint
+    {
+        RunConfig config;
+        tune_t K;
+        tune_t learning_rate;
+        tune_t initial_error;
+        tune_t error;
+        int32_t epochs;
+        tune_t best_error;
+        int32_t best_epoch;
+        bool converged;
+        parameters_t parameters;
+        parameters_t momentum;
+        parameters_t velocity;
+        parameters_t best_parameters;
+    };
+
+    // Everything needed to continue the Adam loop after the given epoch.
+    // The entry count and weight identify the dataset it was written for.
+    // The mini-batch settings determine the batches of every epoch, so a resume with the same ones continues the same sequence.
+    struct Checkpoint
+    {
+        int32_t epoch;
+        uint64_t entry_count;
+        uint64_t total_weight;
+        int64_t batch_size;
+        uint64_t shuffle_seed;
+        uint64_t shuffle_share_count;
+        std::vector<RunCheckpoint> runs;
+    };
+
+    // Returns false if there is no checkpoint at path. Throws if the file is damaged or was written by a build with a different parameter layout.
+    bool load_checkpoint(const std::string& path, Checkpoint& checkpoint);
+
+    // Writes checkpoints on a background thread, to a temporary file that is synced to disk and renamed over the previous checkpoint once complete.
+    // Only the newest checkpoint waiting to be written is kept, so submitting never waits for the disk.
+    class CheckpointWriter
+    {
+    public:
+        explicit CheckpointWriter(std::string path);
+        CheckpointWriter(const CheckpointWriter&) = delete;
+        CheckpointWriter& operator=(const CheckpointWriter&) = delete;
+        // Finishes writing the last submitted checkpoint
+        ~CheckpointWriter();
+
+        // Queues the checkpoint by swapping it with the writer's spare one, so its buffers are reused by the next submit
+        void submit(Checkpoint& checkpoint);
+
+    private:
+        std::string path;
+        std::mutex mutex;
+        std::condition_variable condition;
+        Checkpoint pending;
+        bool has_pending = false;
+        bool should_stop = false;
+        std::thread thread;
+
+        void thread_loop();
+    };
+}
+
+#endif // !CHECKPOINT_H
@@ -21,10 +21,40 @@ constexpr int32_t max_epoch = 5001;
 constexpr bool retune_from_zero = true;
 constexpr bool enable_qsearch = false;
 constexpr bool filter_in_check = false;
+constexpr bool verify_sparse_trace = false;
 constexpr tune_t initial_learning_rate = 1;
 constexpr int32_t learning_rate_drop_interval = 1500;
 constexpr tune_t learning_rate_drop_ratio = 0.7;
 constexpr bool print_data_entries = false;
 constexpr int32_t data_load_print_interval = 10000;
+constexpr bool enable_dataset_cache = true;
+constexpr bool compress_coefficients = false;
+constexpr bool enable_simd_kernels = true;
+constexpr int32_t parallel_grain_size = 16384;
+constexpr bool enable_numa = false;
+constexpr bool deduplicate_entries = false;
+constexpr int64_t batch_size = 0;
+constexpr uint64_t shuffle_seed = 1;
+constexpr int32_t early_stop_window = 0;
+constexpr double early_stop_tolerance = 1e-5;
+constexpr double gradient_norm_tolerance = 0;
+constexpr double time_limit_seconds = 0;
+constexpr int32_t checkpoint_interval = 0;
+constexpr const char* checkpoint_path = "tuner.checkpoint";
+
+enum class OptimizerType
+{
+    Adam,
+    LevenbergMarquardt,
+    Lbfgs
+};
+constexpr OptimizerType optimizer = OptimizerType::Adam;
+constexpr int32_t lm_max_iterations = 50;
+constexpr double lm_initial_damping = 1e-3;
+constexpr double lm_tolerance = 1e-7;
+constexpr int32_t lbfgs_max_iterations = 200;
+constexpr uint32_t lbfgs_history_size = 10;
+constexpr uint32_t lbfgs_line_search_steps = 8;
+constexpr double lbfgs_tolerance = 1e-7;
 
 #endif // !CONFIG_H
@@ -0,0 +1,728 @@
+#include "dataset.h"
+#include "config.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <array>
+#include <cstdio>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <mutex>
+#include <limits>
+#include <stdexcept>
+#include <typeinfo>
+#include <unordered_map>
+
+#if defined(__unix__) || defined(__APPLE__)
+#define DATASET_MMAP 1
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#else
+#define DATASET_MMAP 0
+#endif
+
+using namespace std;
+using namespace Tuner;
+
+static constexpr array<char, 8> cache_magic = { 'T', 'X', 'L', 'C', 'A', 'C', 'H', 'E' };
+static constexpr uint32_t cache_version = 5;
+static constexpr uint64_t cache_alignment = 64;
+
+// Followed by the metadata, offset and coefficient sections, each starting on a cache_alignment boundary
+struct CacheHeader
+{
+    array<char, 8> magic;
+    uint32_t version;
+    uint32_t metadata_size;
+    uint32_t pool_element_size;
+    CacheKey key;
+    uint64_t entry_count;
+    uint64_t pool_size;
+    uint64_t metadata_offset;
+    uint64_t offsets_offset;
+    uint64_t coefficients_offset;
+    uint64_t file_size;
+};
+
+static uint64_t align_up(const uint64_t value)
+{
+    return (value + cache_alignment - 1) / cache_alignment * cache_alignment;
+}
+
+static void set_section_offsets(CacheHeader& header)
+{
+    header.metadata_offset = align_up(sizeof(CacheHeader));
+    header.offsets_offset = align_up(header.metadata_offset + header.entry_count * sizeof(EntryMetadata));
+    header.coefficients_offset = align_up(header.offsets_offset + (header.entry_count + 1) * sizeof(uint64_t));
+    header.file_size = header.coefficients_offset + header.pool_size * sizeof(coefficient_pool_t);
+}
+
+static uint64_t hash_combine(uint64_t hash, const uint64_t value)
+{
+    hash ^= value + 0x9E3779B97F4A7C15ULL + (hash << 6) + (hash >> 2);
+    hash ^= hash >> 31;
+    hash *= 0xBF58476D1CE4E5B9ULL;
+    return hash;
+}
+
+static uint64_t hash_bytes(uint64_t hash, const char* data, const size_t size)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64_t) <= size; i += sizeof(uint64_t))
+    {
+        uint64_t word;
+        memcpy(&word, data + i, sizeof(uint64_t));
+        hash = hash_combine(hash, word);
+    }
+
+    uint64_t tail = 0;
+    memcpy(&tail, data + i, size - i);
+    return hash_combine(hash, tail ^ size);
+}
+
+static uint64_t hash_file(const string& path)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        cout << "Failed to open " << path << endl;
+        throw runtime_error("Failed to open data source");
+    }
+
+    constexpr size_t block_size = 1 << 20;
+    vector<char> block(block_size);
+    uint64_t hash = 0;
+    while (file)
+    {
+        file.read(block.data(), block_size);
+        const auto read = static_cast<size_t>(file.gcount());
+        if (read == 0)
+        {
+            break;
+        }
+        hash = hash_bytes(hash, block.data(), read);
+    }
+    return hash;
+}
+
+static void write_int16(vector<uint8_t>& packed, const int32_t value)
+{
+    const auto bits = static_cast<uint16_t>(static_cast<int16_t>(value));
+    packed.push_back(static_cast<uint8_t>(bits & 0xFF));
+    packed.push_back(static_cast<uint8_t>(bits >> 8));
+}
+
+void Tuner::pack_coefficients(const vector<CoefficientEntry>& coefficients, vector<uint8_t>& packed)
+{
+    int32_t previous_index = -1;
+    for (const auto& coefficient : coefficients)
+    {
+        const auto delta = coefficient.index - previous_index;
+        if (delta > 0 && delta <= 255)
+        {
+            packed.push_back(static_cast<uint8_t>(delta));
+        }
+        else
+        {
+            packed.push_back(packed_index_escape);
+            write_int16(packed, coefficient.index);
+        }
+        previous_index = coefficient.index;
+
+        if (coefficient.value > packed_value_escape && coefficient.value <= 127)
+        {
+            packed.push_back(static_cast<uint8_t>(static_cast<int8_t>(coefficient.value)));
+        }
+        else
+        {
+            packed.push_back(static_cast<uint8_t>(packed_value_escape));
+            write_int16(packed, coefficient.value);
+        }
+    }
+}
+
+// Overloaded on the pool type of the configured storage mode, the other overload is unused
+[[maybe_unused]] static void append_coefficients(const vector<CoefficientEntry>& coefficients, vector<uint8_t>& pool)
+{
+    pack_coefficients(coefficients, pool);
+}
+
+[[maybe_unused]] static void append_coefficients(const vector<CoefficientEntry>& coefficients, vector<CoefficientEntry>& pool)
+{
+    pool.insert(pool.end(), coefficients.begin(), coefficients.end());
+}
+
+SegmentBuilder::SegmentBuilder() : offsets{0}
+{
+}
+
+void SegmentBuilder::append(const Entry& entry)
+{
+    EntryMetadata entry_metadata{};
+    entry_metadata.wdl = entry.wdl;
+    entry_metadata.additional_score = entry.additional_score;
+#if TAPERED
+    entry_metadata.endgame_scale = entry.endgame_scale;
+    entry_metadata.phase = static_cast<uint8_t>(entry.phase);
+#endif
+    entry_metadata.white_to_move = entry.white_to_move;
+    entry_metadata.weight = 1;
+
+    metadata.push_back(entry_metadata);
+    append_coefficients(entry.coefficients, coefficients);
+    offsets.push_back(coefficients.size());
+}
+
+void SegmentBuilder::append(const SegmentBuilder& other)
+{
+    const auto base = coefficients.size();
+    metadata.insert(metadata.end(), other.metadata.begin(), other.metadata.end());
+    coefficients.insert(coefficients.end(), other.coefficients.begin(), other.coefficients.end());
+    for (size_t i = 1; i < other.offsets.size(); i++)
+    {
+        offsets.push_back(base + other.offsets[i]);
+    }
+}
+
+void SegmentBuilder::append(const DataSegment& segment, const uint64_t begin, const uint64_t end)
+{
+    const auto base = coefficients.size();
+    const auto first_offset = segment.offsets[begin];
+    metadata.insert(metadata.end(), segment.metadata + begin, segment.metadata + end);
+    coefficients.insert(coefficients.end(), segment.coefficients + first_offset, segment.coefficients + segment.offsets[end]);
+    for (auto i = begin + 1; i <= end; i++)
+    {
+        offsets.push_back(base + segment.offsets[i] - first_offset);
+    }
+}
+
+uint64_t SegmentBuilder::size() const
+{
+    return metadata.size();
+}
+
+EntryStore::~EntryStore()
+{
+#if DATASET_MMAP
+    for (const auto& mapping : mappings)
+    {
+        munmap(mapping.address, mapping.length);
+    }
+#endif
+}
+
+void EntryStore::add_segment(SegmentBuilder&& builder)
+{
+    add_owned_segment(make_unique<SegmentBuilder>(std::move(builder)));
+}
+
+void EntryStore::add_owned_segment(unique_ptr<SegmentBuilder> builder)
+{
+    auto& owned = owned_segments.emplace_back(std::move(builder));
+    DataSegment segment;
+    segment.size = owned->metadata.size();
+    segment.pool_size = owned->coefficients.size();
+    segment.metadata = owned->metadata.data();
+    segment.offsets = owned->offsets.data();
+    segment.coefficients = owned->coefficients.data();
+    segments.push_back(segment);
+    add_segment_weights(segment);
+}
+
+void EntryStore::add_segment_weights(const DataSegment& segment)
+{
+    for (uint64_t i = 0; i < segment.size; i++)
+    {
+        weight_total += segment.metadata[i].weight;
+    }
+}
+
+// Releases the current segments and takes over the builders in order. The builders are moved by pointer,
+// so their arrays stay where the workers allocated them.
+void EntryStore::replace_segments(vector<unique_ptr<SegmentBuilder>>&& builders)
+{
+#if DATASET_MMAP
+    for (const auto& mapping : mappings)
+    {
+        munmap(mapping.address, mapping.length);
+    }
+#endif
+    mappings.clear();
+    segments.clear();
+    owned_segments.clear();
+    weight_total = 0;
+
+    for (auto& builder : builders)
+    {
+        add_owned_segment(std::move(builder));
+    }
+}
+
+static bool read_cache_header(const string& path, const CacheKey& key, CacheHeader& header)
+{
+    ifstream file(path, ios::binary);
+    if (!file)
+    {
+        return false;
+    }
+
+    file.read(reinterpret_cast<char*>(&header), sizeof(header));
+    if (!file || header.magic != cache_magic || header.version != cache_version
+        || header.metadata_size != sizeof(EntryMetadata) || header.pool_element_size != sizeof(coefficient_pool_t))
+    {
+        cout << "Ignoring incompatible cache " << path << endl;
+        return false;
+    }
+
+    if (header.key.source_hash != key.source_hash
+        || header.key.eval_hash != key.eval_hash
+        || header.key.settings_hash != key.settings_hash
+        || header.key.parameter_count != key.parameter_count)
+    {
+        cout << "Cache " << path << " is out of date" << endl;
+        return false;
+    }
+
+    return true;
+}
+
+bool Tuner::is_cache_current(const string& path, const CacheKey& key)
+{
+    CacheHeader header{};
+    if (!read_cache_header(path, key, header))
+    {
+        return false;
+    }
+
+    // The source was touched without changing, record its new size and time so the next run does not hash it again
+    if (header.key.source_size != key.source_size || header.key.source_modified != key.source_modified)
+    {
+        header.key = key;
+        fstream file(path, ios::binary | ios::in | ios::out);
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    }
+    return true;
+}
+
+bool EntryStore::add_cache(const string& path, const CacheKey& key)
+{
+    CacheHeader header{};
+    if (!read_cache_header(path, key, header))
+    {
+        return false;
+    }
+
+#if DATASET_MMAP
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        return false;
+    }
+
+    struct stat file_stat{};
+    if (fstat(fd, &file_stat) != 0 || static_cast<uint64_t>(file_stat.st_size) < header.file_size)
+    {
+        close(fd);
+        cout << "Cache " << path << " is truncated" << endl;
+        return false;
+    }
+
+    void* address = mmap(nullptr, header.file_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (address == MAP_FAILED)
+    {
+        cout << "Unable to map cache " << path << endl;
+        return false;
+    }
+    mappings.push_back(Mapping{ address, header.file_size });
+
+    const auto* base = static_cast<const char*>(address);
+    DataSegment segment;
+    segment.size = header.entry_count;
+    segment.pool_size = header.pool_size;
+    segment.metadata = reinterpret_cast<const EntryMetadata*>(base + header.metadata_offset);
+    segment.offsets = reinterpret_cast<const uint64_t*>(base + header.offsets_offset);
+    segment.coefficients = reinterpret_cast<const coefficient_pool_t*>(base + header.coefficients_offset);
+    segments.push_back(segment);
+    add_segment_weights(segment);
+#else
+    // No memory mapping available, read the sections into an owned segment instead
+    ifstream file(path, ios::binary);
+    SegmentBuilder builder;
+    builder.metadata.resize(header.entry_count);
+    builder.offsets.resize(header.entry_count + 1);
+    builder.coefficients.resize(header.pool_size);
+
+    file.seekg(static_cast<streamoff>(header.metadata_offset));
+    file.read(reinterpret_cast<char*>(builder.metadata.data()), static_cast<streamsize>(header.entry_count * sizeof(EntryMetadata)));
+    file.seekg(static_cast<streamoff>(header.offsets_offset));
+    file.read(reinterpret_cast<char*>(builder.offsets.data()), static_cast<streamsize>((header.entry_count + 1) * sizeof(uint64_t)));
+    file.seekg(static_cast<streamoff>(header.coefficients_offset));
+    file.read(reinterpret_cast<char*>(builder.coefficients.data()), static_cast<streamsize>(header.pool_size * sizeof(coefficient_pool_t)));
+    if (!file)
+    {
+        cout << "Cache " << path << " is truncated" << endl;
+        return false;
+    }
+    add_segment(std::move(builder));
+#endif
+
+    return true;
+}
+
+uint64_t EntryStore::size() const
+{
+    uint64_t total = 0;
+    for (const auto& segment : segments)
+    {
+        total += segment.size;
+    }
+    return total;
+}
+
+uint64_t EntryStore::pool_size() const
+{
+    uint64_t total = 0;
+    for (const auto& segment : segments)
+    {
+        total += segment.pool_size;
+    }
+    return total;
+}
+
+const vector<DataSegment>& EntryStore::get_segments() const
+{
+    return segments;
+}
+
+void EntryStore::localize(ThreadPool& thread_pool)
+{
+    struct Shard
+    {
+        uint64_t begin;
+        unique_ptr<SegmentBuilder> builder;
+    };
+
+    vector<Shard> shards;
+    mutex shards_mutex;
+    thread_pool.parallel_for(0, size(), 0, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        auto builder = make_unique<SegmentBuilder>();
+        for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_begin, const uint64_t segment_end)
+        {
+            builder->append(segment, segment_begin, segment_end);
+        });
+
+        lock_guard lock(shards_mutex);
+        shards.push_back({ begin, std::move(builder) });
+    });
+
+    sort(shards.begin(), shards.end(), [](const Shard& left, const Shard& right)
+    {
+        return left.begin < right.begin;
+    });
+
+    vector<unique_ptr<SegmentBuilder>> builders;
+    for (auto& shard : shards)
+    {
+        builders.push_back(std::move(shard.builder));
+    }
+    replace_segments(std::move(builders));
+}
+
+uint64_t EntryStore::total_weight() const
+{
+    return weight_total;
+}
+
+double EntryStore::duplicate_error() const
+{
+    return duplicate_error_total;
+}
+
+// Hash of everything that decides an entry's evaluation, i.e. all of it except the result and weight
+static uint64_t hash_entry(const DataSegment& segment, const uint64_t index)
+{
+    const auto& entry = segment.metadata[index];
+    const auto* coefficients = reinterpret_cast<const char*>(segment.coefficients + segment.offsets[index]);
+    const auto coefficients_size = (segment.offsets[index + 1] - segment.offsets[index]) * sizeof(coefficient_pool_t);
+    auto hash = hash_bytes(0, coefficients, coefficients_size);
+    hash = hash_bytes(hash, reinterpret_cast<const char*>(&entry.additional_score), sizeof(entry.additional_score));
+#if TAPERED
+    hash = hash_bytes(hash, reinterpret_cast<const char*>(&entry.endgame_scale), sizeof(entry.endgame_scale));
+    hash = hash_combine(hash, entry.phase);
+#endif
+    return hash_combine(hash, entry.white_to_move);
+}
+
+static bool is_same_position(const DataSegment& left_segment, const uint64_t left, const DataSegment& right_segment, const uint64_t right)
+{
+    const auto& left_entry = left_segment.metadata[left];
+    const auto& right_entry = right_segment.metadata[right];
+    const auto left_size = left_segment.offsets[left + 1] - left_segment.offsets[left];
+    const auto right_size = right_segment.offsets[right + 1] - right_segment.offsets[right];
+    return left_size == right_size
+        && left_entry.additional_score == right_entry.additional_score
+#if TAPERED
+        && left_entry.endgame_scale == right_entry.endgame_scale
+        && left_entry.phase == right_entry.phase
+#endif
+        && left_entry.white_to_move == right_entry.white_to_move
+        && memcmp(left_segment.coefficients + left_segment.offsets[left], right_segment.coefficients + right_segment.offsets[right], left_size * sizeof(coefficient_pool_t)) == 0;
+}
+
+uint64_t EntryStore::deduplicate(ThreadPool& thread_pool)
+{
+    const auto entry_count = size();
+
+    // Segment and index within it of every entry, for random access by global index
+    vector<pair<uint32_t, uint64_t>> locations(entry_count);
+    {
+        uint64_t global_index = 0;
+        for (uint32_t segment_index = 0; segment_index < segments.size(); segment_index++)
+        {
+            for (uint64_t i = 0; i < segments[segment_index].size; i++)
+            {
+                locations[global_index++] = { segment_index, i };
+            }
+        }
+    }
+
+    vector<uint64_t> hashes(entry_count);
+    thread_pool.parallel_for(0, entry_count, parallel_grain_size, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        for (auto i = begin; i < end; i++)
+        {
+            hashes[i] = hash_entry(segments[locations[i].first], locations[i].second);
+        }
+    });
+
+    // Entries are split into shards by hash, each shard finds the first occurrence of every position in it.
+    // The indices of a shard are ascending, so the first entry of a group is its representative.
+    const auto shard_count = static_cast<uint64_t>(thread_pool.thread_count()) * 8;
+    vector<vector<uint64_t>> shards(shard_count);
+    for (uint64_t i = 0; i < entry_count; i++)
+    {
+        shards[hashes[i] % shard_count].push_back(i);
+    }
+
+    vector<uint64_t> representatives(entry_count);
+    thread_pool.parallel_for(0, shard_count, 1, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        for (auto shard_index = begin; shard_index < end; shard_index++)
+        {
+            unordered_multimap<uint64_t, uint64_t> first_occurrences;
+            first_occurrences.reserve(shards[shard_index].size());
+            for (const auto i : shards[shard_index])
+            {
+                representatives[i] = i;
+                const auto [first, last] = first_occurrences.equal_range(hashes[i]);
+                for (auto it = first; it != last; ++it)
+                {
+                    const auto candidate = it->second;
+                    if (is_same_position(segments[locations[candidate].first], locations[candidate].second, segments[locations[i].first], locations[i].second))
+                    {
+                        representatives[i] = candidate;
+                        break;
+                    }
+                }
+                if (representatives[i] == i)
+                {
+                    first_occurrences.emplace(hashes[i], i);
+                }
+            }
+            vector<uint64_t>().swap(shards[shard_index]);
+        }
+    });
+
+    // The weights and weighted result sums of each group are kept at its representative, reusing the hash array
+    vector<uint64_t>& group_weights = hashes;
+    vector<double> group_results(entry_count);
+    fill(group_weights.begin(), group_weights.end(), 0);
+    for (uint64_t i = 0; i < entry_count; i++)
+    {
+        const auto& entry = segments[locations[i].first].metadata[locations[i].second];
+        group_weights[representatives[i]] += entry.weight;
+        group_results[representatives[i]] += static_cast<double>(entry.weight) * entry.wdl;
+    }
+
+    double error = duplicate_error_total;
+    uint64_t removed_count = 0;
+    for (uint64_t i = 0; i < entry_count; i++)
+    {
+        const auto& entry = segments[locations[i].first].metadata[locations[i].second];
+        const auto mean = group_results[representatives[i]] / static_cast<double>(group_weights[representatives[i]]);
+        error += entry.weight * (entry.wdl - mean) * (entry.wdl - mean);
+        if (representatives[i] != i)
+        {
+            removed_count++;
+        }
+        else if (group_weights[i] > numeric_limits<uint32_t>::max())
+        {
+            throw runtime_error("Too many duplicates of a single position");
+        }
+    }
+
+    // Every worker copies the representatives of its share, like localize
+    struct Shard
+    {
+        uint64_t begin;
+        unique_ptr<SegmentBuilder> builder;
+    };
+
+    vector<Shard> built_shards;
+    mutex shards_mutex;
+    thread_pool.parallel_for(0, entry_count, 0, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        auto builder = make_unique<SegmentBuilder>();
+        for (auto i = begin; i < end; i++)
+        {
+            if (representatives[i] != i)
+            {
+                continue;
+            }
+
+            builder->append(segments[locations[i].first], locations[i].second, locations[i].second + 1);
+            auto& entry = builder->metadata.back();
+            entry.weight = static_cast<uint32_t>(group_weights[i]);
+            entry.wdl = static_cast<tune_t>(group_results[i] / static_cast<double>(group_weights[i]));
+        }
+
+        lock_guard lock(shards_mutex);
+        built_shards.push_back({ begin, std::move(builder) });
+    });
+
+    sort(built_shards.begin(), built_shards.end(), [](const Shard& left, const Shard& right)
+    {
+        return left.begin < right.begin;
+    });
+
+    vector<unique_ptr<SegmentBuilder>> builders;
+    for (auto& shard : built_shards)
+    {
+        builders.push_back(std::move(shard.builder));
+    }
+
+    const auto previous_weight = weight_total;
+    replace_segments(std::move(builders));
+    duplicate_error_total = error;
+    if (weight_total != previous_weight)
+    {
+        throw runtime_error("Deduplication changed the number of positions");
+    }
+    return removed_count;
+}
+
+string Tuner::get_cache_path(const DataSource& source)
+{
+    return source.path + ".cache";
+}
+
+// Hashing reads the whole source, so the hash stored in an existing cache is reused while the size and modification time match
+static uint64_t get_source_hash(const DataSource& source, const uint64_t size, const int64_t modified)
+{
+    ifstream file(get_cache_path(source), ios::binary);
+    CacheHeader header{};
+    if (file.read(reinterpret_cast<char*>(&header), sizeof(header)) && header.magic == cache_magic && header.version == cache_version
+        && header.key.source_size == size && header.key.source_modified == modified)
+    {
+        return header.key.source_hash;
+    }
+    return hash_file(source.path);
+}
+
+CacheKey Tuner::get_cache_key(const DataSource& source, const parameters_t& parameters)
+{
+    error_code error;
+    const auto size = filesystem::file_size(source.path, error);
+    const auto modified = filesystem::last_write_time(source.path, error);
+    if (error)
+    {
+        cout << "Failed to open " << source.path << endl;
+        throw runtime_error("Failed to open data source");
+    }
+
+    CacheKey key{};
+    key.source_size = size;
+    key.source_modified = static_cast<int64_t>(modified.time_since_epoch().count());
+    key.source_hash = get_source_hash(source, key.source_size, key.source_modified);
+
+    // The class name alone misses changes to the evaluation code, trace_version is bumped for those
+    const string eval_name = typeid(TuneEval).name();
+    const auto initial_parameters = TuneEval::get_initial_parameters();
+    uint64_t eval_hash = hash_bytes(0, eval_name.data(), eval_name.size());
+    eval_hash = hash_combine(eval_hash, TuneEval::trace_version);
+    eval_hash = hash_combine(eval_hash, initial_parameters.size());
+    key.eval_hash = hash_bytes(eval_hash, reinterpret_cast<const char*>(initial_parameters.data()), initial_parameters.size() * sizeof(initial_parameters[0]));
+
+    // The initial parameters matter for additional_score and qsearch
+    uint64_t settings_hash = hash_bytes(0, reinterpret_cast<const char*>(parameters.data()), parameters.size() * sizeof(parameters[0]));
+    settings_hash = hash_combine(settings_hash, TAPERED);
+    settings_hash = hash_combine(settings_hash, sizeof(tune_t));
+    settings_hash = hash_combine(settings_hash, TuneEval::includes_additional_score);
+    settings_hash = hash_combine(settings_hash, enable_qsearch);
+    settings_hash = hash_combine(settings_hash, filter_in_check);
+    settings_hash = hash_combine(settings_hash, source.side_to_move_wdl);
+    settings_hash = hash_combine(settings_hash, static_cast<uint64_t>(source.position_limit));
+    key.settings_hash = settings_hash;
+
+    key.parameter_count = parameters.size();
+    return key;
+}
+
+static void write_padding(ofstream& file, const uint64_t offset)
+{
+    static constexpr array<char, cache_alignment> zeros{};
+    const auto position = static_cast<uint64_t>(file.tellp());
+    file.write(zeros.data(), static_cast<streamsize>(offset - position));
+}
+
+void Tuner::save_cache(const string& path, const CacheKey& key, const SegmentBuilder& builder)
+{
+    CacheHeader header{};
+    header.magic = cache_magic;
+    header.version = cache_version;
+    header.metadata_size = sizeof(EntryMetadata);
+    header.pool_element_size = sizeof(coefficient_pool_t);
+    header.key = key;
+    header.entry_count = builder.metadata.size();
+    header.pool_size = builder.coefficients.size();
+    set_section_offsets(header);
+
+    // Written to a temporary file first so an interrupted run never leaves a broken cache behind
+    const auto temp_path = path + ".tmp";
+    {
+        ofstream file(temp_path, ios::binary | ios::trunc);
+        if (!file)
+        {
+            cout << "Unable to write cache " << temp_path << endl;
+            return;
+        }
+
+        file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+        write_padding(file, header.metadata_offset);
+        file.write(reinterpret_cast<const char*>(builder.metadata.data()), static_cast<streamsize>(header.entry_count * sizeof(EntryMetadata)));
+        write_padding(file, header.offsets_offset);
+        file.write(reinterpret_cast<const char*>(builder.offsets.data()), static_cast<streamsize>((header.entry_count + 1) * sizeof(uint64_t)));
+        write_padding(file, header.coefficients_offset);
+        file.write(reinterpret_cast<const char*>(builder.coefficients.data()), static_cast<streamsize>(header.pool_size * sizeof(coefficient_pool_t)));
+
+        if (!file)
+        {
+            cout << "Unable to write cache " << temp_path << endl;
+            file.close();
+            remove(temp_path.c_str());
+            return;
+        }
+    }
+
+    if (rename(temp_path.c_str(), path.c_str()) != 0)
+    {
+        cout << "Unable to move cache into place at " << path << endl;
+        remove(temp_path.c_str());
+    }
+}
@@ -0,0 +1,300 @@
+#ifndef DATASET_H
+#define DATASET_H 1
+
+#include "base.h"
+#include "config.h"
+#include "tuner.h"
+
+#include <cstdint>
+#include <memory>
+#include <span>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+class ThreadPool;
+
+namespace Tuner
+{
+    // A single position while it is being extracted, before it is appended to a segment
+    struct Entry
+    {
+        std::vector<CoefficientEntry> coefficients;
+        tune_t wdl;
+        bool white_to_move;
+        //tune_t initial_eval;
+        tune_t additional_score;
+#if TAPERED
+        int32_t phase;
+        tune_t endgame_scale;
+#endif
+    };
+
+    // Per-entry data stored next to the coefficient pool.
+    // weight is the number of identical positions merged into the entry, and wdl their mean result.
+    struct EntryMetadata
+    {
+        tune_t wdl;
+        tune_t additional_score;
+#if TAPERED
+        tune_t endgame_scale;
+#endif
+        uint32_t weight;
+#if TAPERED
+        uint8_t phase;
+#endif
+        uint8_t white_to_move;
+    };
+
+    // Compressed coefficients are stored as one record per coefficient:
+    //   index delta from the previous coefficient as uint8, 0 followed by the absolute int16 index if it does not fit in 1..255
+    //   value as int8, -128 followed by the int16 value if it does not fit in -127..127
+    // Coefficients must be appended in ascending index order for the deltas to stay small.
+    constexpr uint8_t packed_index_escape = 0;
+    constexpr int8_t packed_value_escape = -128;
+
+    class PackedCoefficientRange
+    {
+    public:
+        struct Sentinel
+        {
+            const uint8_t* end;
+        };
+
+        class Iterator
+        {
+        public:
+            Iterator(const uint8_t* position, const uint8_t* end) : position(position), next_position(position), end(end), index(-1), current{}
+            {
+                if (position != end)
+                {
+                    decode();
+                }
+            }
+
+            const CoefficientEntry& operator*() const
+            {
+                return current;
+            }
+
+            Iterator& operator++()
+            {
+                position = next_position;
+                if (position != end)
+                {
+                    decode();
+                }
+                return *this;
+            }
+
+            bool operator!=(const Sentinel& sentinel) const
+            {
+                return position != sentinel.end;
+            }
+
+        private:
+            const uint8_t* position;
+            const uint8_t* next_position;
+            const uint8_t* end;
+            int32_t index;
+            CoefficientEntry current;
+
+            static int16_t read_int16(const uint8_t* data)
+            {
+                return static_cast<int16_t>(static_cast<uint16_t>(data[0] | (data[1] << 8)));
+            }
+
+            void decode()
+            {
+                const uint8_t* data = position;
+                const uint8_t delta = data[0];
+                const auto value = static_cast<int8_t>(data[1]);
+                if (delta != packed_index_escape && value != packed_value_escape) [[likely]]
+                {
+                    index += delta;
+                    current.index = static_cast<int16_t>(index);
+                    current.value = value;
+                    next_position = data + 2;
+                    return;
+                }
+
+                if (delta == packed_index_escape)
+                {
+                    index = read_int16(data + 1);
+                    data += 3;
+                }
+                else
+                {
+                    index += delta;
+                    data += 1;
+                }
+
+                const auto escaped_value = static_cast<int8_t>(*data++);
+                if (escaped_value == packed_value_escape)
+                {
+                    current.value = read_int16(data);
+                    data += 2;
+                }
+                else
+                {
+                    current.value = escaped_value;
+                }
+
+                current.index = static_cast<int16_t>(index);
+                next_position = data;
+            }
+        };
+
+        PackedCoefficientRange(const uint8_t* begin, const uint8_t* end) : first(begin), last(end)
+        {
+        }
+
+        Iterator begin() const
+        {
+            return Iterator(first, last);
+        }
+
+        Sentinel end() const
+        {
+            return Sentinel{ last };
+        }
+
+    private:
+        const uint8_t* first;
+        const uint8_t* last;
+    };
+
+    void pack_coefficients(const std::vector<CoefficientEntry>& coefficients, std::vector<uint8_t>& packed);
+
+    // Element type of the coefficient pool for the configured storage mode
+    using coefficient_pool_t = std::conditional_t<compress_coefficients, uint8_t, CoefficientEntry>;
+
+    // Flat view of a block of entries. The coefficients of entry i are coefficients[offsets[i]] to coefficients[offsets[i + 1]].
+    // The arrays are either owned by the store or memory mapped from a dataset cache.
+    struct DataSegment
+    {
+        uint64_t size = 0;
+        uint64_t pool_size = 0;
+        const EntryMetadata* metadata = nullptr;
+        const uint64_t* offsets = nullptr;
+        const coefficient_pool_t* coefficients = nullptr;
+
+        template<bool Packed = compress_coefficients>
+        auto get_coefficients(const uint64_t index) const
+        {
+            if constexpr (Packed)
+            {
+                return PackedCoefficientRange(coefficients + offsets[index], coefficients + offsets[index + 1]);
+            }
+            else
+            {
+                return std::span<const CoefficientEntry>(coefficients + offsets[index], coefficients + offsets[index + 1]);
+            }
+        }
+    };
+
+    // Everything that influences the entries extracted from a data source.
+    // A cache is only reused when all of these match.
+    struct CacheKey
+    {
+        uint64_t source_hash;
+        uint64_t source_size;
+        int64_t source_modified;
+        uint64_t eval_hash;
+        uint64_t settings_hash;
+        uint64_t parameter_count;
+    };
+
+    class SegmentBuilder
+    {
+    public:
+        SegmentBuilder();
+        void append(const Entry& entry);
+        void append(const SegmentBuilder& other);
+        void append(const DataSegment& segment, uint64_t begin, uint64_t end);
+        uint64_t size() const;
+
+    private:
+        friend class EntryStore;
+        friend void save_cache(const std::string& path, const CacheKey& key, const SegmentBuilder& builder);
+
+        std::vector<EntryMetadata> metadata;
+        std::vector<uint64_t> offsets;
+        std::vector<coefficient_pool_t> coefficients;
+    };
+
+    class EntryStore
+    {
+    public:
+        EntryStore() = default;
+        EntryStore(const EntryStore&) = delete;
+        EntryStore& operator=(const EntryStore&) = delete;
+        ~EntryStore();
+
+        void add_segment(SegmentBuilder&& builder);
+        bool add_cache(const std::string& path, const CacheKey& key);
+        uint64_t size() const;
+        uint64_t pool_size() const;
+        const std::vector<DataSegment>& get_segments() const;
+
+        // Number of positions the entries stand for, the sum of their weights
+        uint64_t total_weight() const;
+
+        // Squared error the merged positions have against the mean result of their entry. Constant during tuning,
+        // it is added to the weighted error of the entries so the reported error matches the undeduplicated data.
+        double duplicate_error() const;
+
+        // Merges entries with identical coefficients, phase, endgame scale, additional score and side to move
+        // into one entry, weighted by the number of merged positions, keeping the order of first occurrence.
+        // Returns the number of entries removed. The result is built on the heap, also when the entries were mapped from a cache.
+        uint64_t deduplicate(ThreadPool& thread_pool);
+
+        // Copies the entries into one segment per worker share of parallel_for, built by the worker running it
+        // so the pages are first touched on that worker's NUMA node, and releases the previous segments.
+        // A share stolen by a worker on another node ends up on that node, so placement is best-effort.
+        // The copy is on the heap, so a dataset mapped from a cache has to fit in memory afterwards.
+        void localize(ThreadPool& thread_pool);
+
+        // Calls func(segment, segment_begin, segment_end) for every segment overlapping the global range [begin, end)
+        template<typename F>
+        void for_each_range(const uint64_t begin, const uint64_t end, F&& func) const
+        {
+            uint64_t segment_start = 0;
+            for (const auto& segment : segments)
+            {
+                const auto segment_stop = segment_start + segment.size;
+                if (begin < segment_stop && end > segment_start)
+                {
+                    const auto local_begin = begin > segment_start ? begin - segment_start : 0;
+                    const auto local_end = (end < segment_stop ? end : segment_stop) - segment_start;
+                    func(segment, local_begin, local_end);
+                }
+                segment_start = segment_stop;
+            }
+        }
+
+    private:
+        struct Mapping
+        {
+            void* address;
+            size_t length;
+        };
+
+        std::vector<DataSegment> segments;
+        std::vector<std::unique_ptr<SegmentBuilder>> owned_segments;
+        std::vector<Mapping> mappings;
+        uint64_t weight_total = 0;
+        double duplicate_error_total = 0;
+
+        void add_owned_segment(std::unique_ptr<SegmentBuilder> builder);
+        void add_segment_weights(const DataSegment& segment);
+        void replace_segments(std::vector<std::unique_ptr<SegmentBuilder>>&& builders);
+    };
+
+    std::string get_cache_path(const DataSource& source);
+    CacheKey get_cache_key(const DataSource& source, const parameters_t& parameters);
+    bool is_cache_current(const std::string& path, const CacheKey& key);
+    void save_cache(const std::string& path, const CacheKey& key, const SegmentBuilder& builder);
+}
+
+#endif // !DATASET_H
@@ -19,11 +19,18 @@ constexpr const static bool includeKingZoneAttacks = true;
 constexpr const static bool includeMobility = true;
 constexpr const static bool includePSTs = true;
 
-// If you add new terms, you need to include them in 3 places
-// ParameterChessBoard coefficients
+// Index the slider attack table with PEXT instead of the magics when building with BMI2 (-mbmi2 or -march=native).
+// Without BMI2 in the build the magics are always used.
+// Turn this off on AMD CPUs before Zen 3, where PEXT is microcoded and much slower than a multiply.
+constexpr const static bool usePextAttacks = true;
+
+// If you add new terms, you need to include them in 4 places
+// ParameterChessBoard getCoefficients
+// ParameterChessBoard traceCoefficients
 // amethyst_tapered get_initial_parameters
 // amethyst_tapered print_parameters
 
 // I think that should be enough
+// Run tuner --check-trace afterwards to make sure getCoefficients and traceCoefficients still agree
 
 #endif //TUNER_AMETHYST_CONFIG_H
@@ -27,8 +27,67 @@ EvalResult AmethystEvalTapered::get_fen_eval_result(const std::string& fen) {
     result.score = 0;
     return result;
 }
+// chess::Board numbers squares 8 * rank + file and ParameterChessBoard numbers them 8 * file + rank,
+// so every bitboard is flipped about the a1-h8 diagonal
+static unsigned long flipDiagonal(unsigned long bitboard) {
+    constexpr unsigned long k1 = 0x5500550055005500ULL;
+    constexpr unsigned long k2 = 0x3333000033330000ULL;
+    constexpr unsigned long k4 = 0x0f0f0f0f00000000ULL;
+    unsigned long t = k4 & (bitboard ^ (bitboard << 28));
+    bitboard ^= t ^ (t >> 28);
+    t = k2 & (bitboard ^ (bitboard << 14));
+    bitboard ^= t ^ (t >> 14);
+    t = k1 & (bitboard ^ (bitboard << 7));
+    bitboard ^= t ^ (t >> 7);
+    return bitboard;
+}
+
+static int flipSquare(const chess::Square square) {
+    return 8 * static_cast<int>(square.file()) + static_cast<int>(square.rank());
+}
+
+// Copies the bitboards straight across instead of formatting a FEN and parsing it again
+static ParameterChessBoard boardFromChessBoard(const chess::Board& board) {
+    using chess::Color;
+    using chess::PieceType;
+    using CastlingSide = chess::Board::CastlingRights::Side;
+
+    unsigned long whitePieces[5];
+    unsigned long blackPieces[5];
+    const PieceType pieceTypes[5] = {PieceType::QUEEN, PieceType::ROOK, PieceType::BISHOP, PieceType::KNIGHT, PieceType::PAWN};
+    for (int pieceType = QUEEN_CODE; pieceType <= PAWN_CODE; pieceType++) {
+        whitePieces[pieceType] = flipDiagonal(board.pieces(pieceTypes[pieceType], Color::WHITE).getBits());
+        blackPieces[pieceType] = flipDiagonal(board.pieces(pieceTypes[pieceType], Color::BLACK).getBits());
+    }
+
+    const auto castlingRights = board.castlingRights();
+    const auto enPassantSquare = board.enpassantSq();
+    const int enPassantFile = enPassantSquare == chess::Square::underlying::NO_SQ ? 255 : static_cast<int>(enPassantSquare.file());
+    return ParameterChessBoard::boardFromBitboards(whitePieces, blackPieces,
+                                                   flipSquare(board.kingSq(Color::WHITE)),
+                                                   flipSquare(board.kingSq(Color::BLACK)),
+                                                   board.sideToMove() == Color::WHITE,
+                                                   castlingRights.has(Color::WHITE, CastlingSide::KING_SIDE),
+                                                   castlingRights.has(Color::WHITE, CastlingSide::QUEEN_SIDE),
+                                                   castlingRights.has(Color::BLACK, CastlingSide::KING_SIDE),
+                                                   castlingRights.has(Color::BLACK, CastlingSide::QUEEN_SIDE),
+                                                   enPassantFile, static_cast<int>(board.halfMoveClock()));
+}
+
 EvalResult AmethystEvalTapered::get_external_eval_result(const chess::Board &board) {
-    assert(false); // This is not supported
+    ParameterChessBoard parameterBoard = boardFromChessBoard(board);
+    EvalResult result;
+    result.coefficients = parameterBoard.getCoefficients();
+    result.score = 0;
+    return result;
+}
+void AmethystEvalTapered::get_fen_trace(const std::string& fen, SparseTrace& trace) {
+    ParameterChessBoard board = ParameterChessBoard::boardFromFENNotation(fen);
+    board.traceCoefficients(trace);
+}
+void AmethystEvalTapered::get_external_trace(const chess::Board& board, SparseTrace& trace) {
+    ParameterChessBoard parameterBoard = boardFromChessBoard(board);
+    parameterBoard.traceCoefficients(trace);
 }
 
 parameters_t AmethystEvalTapered::get_initial_parameters()
@@ -17,11 +17,15 @@ namespace Toy
     {
     public:
         constexpr static bool includes_additional_score = false;
-        constexpr static bool supports_external_chess_eval = false;
+        constexpr static bool supports_external_chess_eval = true;
+        constexpr static bool supports_sparse_trace = true;
+        constexpr static uint32_t trace_version = 1;
 
         static parameters_t get_initial_parameters();
         static EvalResult get_fen_eval_result(const std::string& fen);
         static EvalResult get_external_eval_result(const chess::Board& board);
+        static void get_fen_trace(const std::string& fen, SparseTrace& trace);
+        static void get_external_trace(const chess::Board& board, SparseTrace& trace);
         static void print_parameters(const parameters_t& parameters);
     };
 }
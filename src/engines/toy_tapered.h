@@ -15,6 +15,8 @@ namespace Toy
     public:
         constexpr static bool includes_additional_score = false;
         constexpr static bool supports_external_chess_eval = false;
+        constexpr static bool supports_sparse_trace = false;
+        constexpr static uint32_t trace_version = 1;
 
         static parameters_t get_initial_parameters();
         static EvalResult get_fen_eval_result(const std::string& fen);
@@ -0,0 +1,389 @@
+#include "kernels.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+
+#if KERNELS_X86
+#include <immintrin.h>
+#endif
+
+using namespace std;
+using namespace Tuner;
+using namespace Kernels;
+
+KernelType Kernels::detect_kernel()
+{
+#if KERNELS_X86
+    if constexpr (simd_supported)
+    {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f"))
+        {
+            return KernelType::Avx512;
+        }
+        if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+        {
+            return KernelType::Avx2;
+        }
+    }
+#endif
+    return KernelType::Scalar;
+}
+
+const char* Kernels::get_kernel_name(const KernelType type)
+{
+    switch (type)
+    {
+    case KernelType::Avx2:
+        return "AVX2";
+    case KernelType::Avx512:
+        return "AVX-512";
+    default:
+        return "scalar";
+    }
+}
+
+#if KERNELS_X86 && TAPERED && !SINGLE_PRECISION
+
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+
+static_assert(sizeof(pair_t) == 2 * sizeof(double), "Parameters must be interleaved midgame/endgame doubles");
+static_assert(sizeof(CoefficientEntry) == 4, "Coefficient entries are loaded as packed value/index pairs");
+
+// Points each lane of the block at its entry's coefficients. With compressed storage the entries are decoded into
+// decoded first, which the packed format allows at most one coefficient per 2 bytes of, so it is sized once per block.
+static void load_coefficients(const DataSegment& segment, const uint64_t block, const int count, vector<CoefficientEntry>& decoded, const CoefficientEntry** lane_coefficients, uint64_t* lane_counts)
+{
+    if constexpr (compress_coefficients)
+    {
+        decoded.resize((segment.offsets[block + count] - segment.offsets[block]) / 2);
+        auto* output = decoded.data();
+        for (int lane = 0; lane < count; lane++)
+        {
+            lane_coefficients[lane] = output;
+            for (const auto& coefficient : segment.get_coefficients(block + lane))
+            {
+                *output++ = coefficient;
+            }
+            lane_counts[lane] = static_cast<uint64_t>(output - lane_coefficients[lane]);
+        }
+    }
+    else
+    {
+        const auto* coefficients = reinterpret_cast<const CoefficientEntry*>(segment.coefficients);
+        for (int lane = 0; lane < count; lane++)
+        {
+            lane_coefficients[lane] = coefficients + segment.offsets[block + lane];
+            lane_counts[lane] = segment.offsets[block + lane + 1] - segment.offsets[block + lane];
+        }
+    }
+}
+
+// exp(x) = 2^n * exp(r) with x = n * ln(2) + r and |r| <= ln(2) / 2.
+// exp(r) uses a degree 12 Taylor polynomial, accurate to about 2e-16 relative error on that range.
+static constexpr double exp_limit = 708;
+static constexpr double log2e = 1.4426950408889634;
+static constexpr double ln2_hi = 6.93145751953125e-1;
+static constexpr double ln2_lo = 1.42860682030941723212e-6;
+static constexpr double round_magic = 6755399441055744.0; // 2^52 + 2^51
+static constexpr double exp_coefficients[] =
+{
+    1.0 / 479001600, 1.0 / 39916800, 1.0 / 3628800, 1.0 / 362880, 1.0 / 40320, 1.0 / 5040, 1.0 / 720,
+    1.0 / 120, 1.0 / 24, 1.0 / 6, 1.0 / 2, 1.0, 1.0
+};
+
+static void load_lane(const DataSegment& segment, const uint64_t index, double* phases, double* additional_scores, double* wdls, double* endgame_scales, double* weights, const int lane)
+{
+    const auto& entry = segment.metadata[index];
+    phases[lane] = entry.phase;
+    additional_scores[lane] = entry.additional_score;
+    wdls[lane] = entry.wdl;
+    endgame_scales[lane] = entry.endgame_scale;
+    weights[lane] = entry.weight;
+}
+
+// Lanes past the end of the range contribute nothing to the error or gradient
+static void clear_lane(double* midgames, double* endgames, double* phases, double* additional_scores, double* wdls, double* endgame_scales, double* weights, const int lane)
+{
+    midgames[lane] = 0;
+    endgames[lane] = 0;
+    phases[lane] = 0;
+    additional_scores[lane] = 0;
+    wdls[lane] = 0.5;
+    endgame_scales[lane] = 1;
+    weights[lane] = 0;
+}
+
+TARGET_AVX2 static __m256d exp_avx2(__m256d x)
+{
+    x = _mm256_max_pd(_mm256_min_pd(x, _mm256_set1_pd(exp_limit)), _mm256_set1_pd(-exp_limit));
+    const __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m256d r = _mm256_fnmadd_pd(n, _mm256_set1_pd(ln2_hi), x);
+    r = _mm256_fnmadd_pd(n, _mm256_set1_pd(ln2_lo), r);
+
+    __m256d p = _mm256_set1_pd(exp_coefficients[0]);
+    for (int i = 1; i < 13; i++)
+    {
+        p = _mm256_fmadd_pd(p, r, _mm256_set1_pd(exp_coefficients[i]));
+    }
+
+    const __m256d magic = _mm256_set1_pd(round_magic);
+    __m256i bits = _mm256_sub_epi64(_mm256_castpd_si256(_mm256_add_pd(n, magic)), _mm256_castpd_si256(magic));
+    bits = _mm256_slli_epi64(_mm256_add_epi64(bits, _mm256_set1_epi64x(1023)), 52);
+    return _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+}
+
+TARGET_AVX2 static double horizontal_sum_avx2(const __m256d x)
+{
+    const __m128d sum = _mm_add_pd(_mm256_castpd256_pd128(x), _mm256_extractf128_pd(x, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(sum, _mm_unpackhi_pd(sum, sum)));
+}
+
+// Midgame/endgame pair loads for the coefficients left over after the gathers.
+TARGET_AVX2 static __m128d dot_pairs(const CoefficientEntry* coefficients, uint64_t i, const uint64_t count, const double* parameters, __m128d sum)
+{
+    for (; i < count; i++)
+    {
+        sum = _mm_fmadd_pd(_mm_set1_pd(coefficients[i].value), _mm_loadu_pd(parameters + 2 * coefficients[i].index), sum);
+    }
+    return sum;
+}
+
+// Splits 4 packed coefficient entries into their values (as doubles) and the offsets of their midgame parameters.
+// On x86 the value is the low and the index the high half of each 32-bit entry.
+TARGET_AVX2 static void unpack_avx2(const CoefficientEntry* coefficients, __m256d& values, __m128i& offsets)
+{
+    const __m128i packed = _mm_loadu_si128(reinterpret_cast<const __m128i*>(coefficients));
+    values = _mm256_cvtepi32_pd(_mm_srai_epi32(_mm_slli_epi32(packed, 16), 16));
+    offsets = _mm_slli_epi32(_mm_srai_epi32(packed, 16), 1);
+}
+
+// Sparse dot product of an entry's coefficients with the parameters, 4 coefficients at a time.
+// The midgame and endgame parameters are gathered with the doubled indices, one accumulator each.
+TARGET_AVX2 static void dot_avx2(const CoefficientEntry* coefficients, const uint64_t count, const double* parameters, double& midgame, double& endgame)
+{
+    __m256d mg_sum = _mm256_setzero_pd();
+    __m256d eg_sum = _mm256_setzero_pd();
+    uint64_t i = 0;
+    for (; i + 4 <= count; i += 4)
+    {
+        __m256d values;
+        __m128i offsets;
+        unpack_avx2(coefficients + i, values, offsets);
+        mg_sum = _mm256_fmadd_pd(values, _mm256_i32gather_pd(parameters, offsets, 8), mg_sum);
+        eg_sum = _mm256_fmadd_pd(values, _mm256_i32gather_pd(parameters + 1, offsets, 8), eg_sum);
+    }
+
+    const __m128d rest = dot_pairs(coefficients, i, count, parameters, _mm_setzero_pd());
+    midgame = horizontal_sum_avx2(mg_sum) + _mm_cvtsd_f64(rest);
+    endgame = horizontal_sum_avx2(eg_sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(rest, rest));
+}
+
+TARGET_AVX2 static void scatter_gradient_avx2(const CoefficientEntry* coefficients, const uint64_t count, const double mg_base, const double eg_base, double* gradient)
+{
+    const __m128d base = _mm_set_pd(eg_base, mg_base);
+    for (uint64_t i = 0; i < count; i++)
+    {
+        double* pair = gradient + 2 * coefficients[i].index;
+        _mm_storeu_pd(pair, _mm_fmadd_pd(base, _mm_set1_pd(coefficients[i].value), _mm_loadu_pd(pair)));
+    }
+}
+
+template<bool Gradient>
+TARGET_AVX2 static double sweep_avx2(const DataSegment& segment, const uint64_t begin, const uint64_t end, const double* parameters, const double K, double* gradient)
+{
+    constexpr int width = 4;
+    vector<CoefficientEntry> decoded;
+    const CoefficientEntry* lane_coefficients[width];
+    uint64_t lane_counts[width];
+    alignas(32) double midgames[width];
+    alignas(32) double endgames[width];
+    alignas(32) double phases[width];
+    alignas(32) double additional_scores[width];
+    alignas(32) double wdls[width];
+    alignas(32) double endgame_scales[width];
+    alignas(32) double weights[width];
+    alignas(32) double mg_bases[width];
+    alignas(32) double eg_bases[width];
+
+    __m256d error_sum = _mm256_setzero_pd();
+    const __m256d scale = _mm256_set1_pd(-K / 400);
+    const __m256d one = _mm256_set1_pd(1);
+    const __m256d phase_total = _mm256_set1_pd(24);
+    for (uint64_t block = begin; block < end; block += width)
+    {
+        const auto count = static_cast<int>(min<uint64_t>(width, end - block));
+        load_coefficients(segment, block, count, decoded, lane_coefficients, lane_counts);
+        for (int lane = 0; lane < width; lane++)
+        {
+            if (lane < count)
+            {
+                dot_avx2(lane_coefficients[lane], lane_counts[lane], parameters, midgames[lane], endgames[lane]);
+                load_lane(segment, block + lane, phases, additional_scores, wdls, endgame_scales, weights, lane);
+            }
+            else
+            {
+                clear_lane(midgames, endgames, phases, additional_scores, wdls, endgame_scales, weights, lane);
+            }
+        }
+
+        const __m256d phase = _mm256_load_pd(phases);
+        const __m256d endgame_scale = _mm256_load_pd(endgame_scales);
+        const __m256d endgame = _mm256_mul_pd(_mm256_load_pd(endgames), endgame_scale);
+        const __m256d mixed = _mm256_fmadd_pd(_mm256_load_pd(midgames), phase, _mm256_mul_pd(endgame, _mm256_sub_pd(phase_total, phase)));
+        const __m256d eval = _mm256_add_pd(_mm256_load_pd(additional_scores), _mm256_div_pd(mixed, phase_total));
+        const __m256d sig = _mm256_div_pd(one, _mm256_add_pd(one, exp_avx2(_mm256_mul_pd(scale, eval))));
+        const __m256d diff = _mm256_sub_pd(_mm256_load_pd(wdls), sig);
+        const __m256d weighted_diff = _mm256_mul_pd(diff, _mm256_load_pd(weights));
+        error_sum = _mm256_fmadd_pd(weighted_diff, diff, error_sum);
+
+        if constexpr (Gradient)
+        {
+            const __m256d res = _mm256_mul_pd(_mm256_mul_pd(weighted_diff, sig), _mm256_sub_pd(one, sig));
+            const __m256d mg_base = _mm256_mul_pd(res, _mm256_div_pd(phase, phase_total));
+            _mm256_store_pd(mg_bases, mg_base);
+            _mm256_store_pd(eg_bases, _mm256_mul_pd(_mm256_sub_pd(res, mg_base), endgame_scale));
+            for (int lane = 0; lane < count; lane++)
+            {
+                scatter_gradient_avx2(lane_coefficients[lane], lane_counts[lane], mg_bases[lane], eg_bases[lane], gradient);
+            }
+        }
+    }
+
+    return horizontal_sum_avx2(error_sum);
+}
+
+TARGET_AVX512 static __m512d exp_avx512(__m512d x)
+{
+    x = _mm512_max_pd(_mm512_min_pd(x, _mm512_set1_pd(exp_limit)), _mm512_set1_pd(-exp_limit));
+    const __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(log2e)), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+    __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(ln2_hi), x);
+    r = _mm512_fnmadd_pd(n, _mm512_set1_pd(ln2_lo), r);
+
+    __m512d p = _mm512_set1_pd(exp_coefficients[0]);
+    for (int i = 1; i < 13; i++)
+    {
+        p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(exp_coefficients[i]));
+    }
+
+    const __m512d magic = _mm512_set1_pd(round_magic);
+    __m512i bits = _mm512_sub_epi64(_mm512_castpd_si512(_mm512_add_pd(n, magic)), _mm512_castpd_si512(magic));
+    bits = _mm512_slli_epi64(_mm512_add_epi64(bits, _mm512_set1_epi64(1023)), 52);
+    return _mm512_mul_pd(p, _mm512_castsi512_pd(bits));
+}
+
+// Splits 8 packed coefficient entries into their values (as doubles) and the offsets of their midgame parameters.
+TARGET_AVX512 static void unpack_avx512(const CoefficientEntry* coefficients, __m512d& values, __m256i& offsets)
+{
+    const __m256i packed = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(coefficients));
+    values = _mm512_cvtepi32_pd(_mm256_srai_epi32(_mm256_slli_epi32(packed, 16), 16));
+    offsets = _mm256_slli_epi32(_mm256_srai_epi32(packed, 16), 1);
+}
+
+TARGET_AVX512 static void dot_avx512(const CoefficientEntry* coefficients, const uint64_t count, const double* parameters, double& midgame, double& endgame)
+{
+    __m512d mg_sum = _mm512_setzero_pd();
+    __m512d eg_sum = _mm512_setzero_pd();
+    uint64_t i = 0;
+    for (; i + 8 <= count; i += 8)
+    {
+        __m512d values;
+        __m256i offsets;
+        unpack_avx512(coefficients + i, values, offsets);
+        mg_sum = _mm512_fmadd_pd(values, _mm512_i32gather_pd(offsets, parameters, 8), mg_sum);
+        eg_sum = _mm512_fmadd_pd(values, _mm512_i32gather_pd(offsets, parameters + 1, 8), eg_sum);
+    }
+
+    const __m128d rest = dot_pairs(coefficients, i, count, parameters, _mm_setzero_pd());
+    midgame = _mm512_reduce_add_pd(mg_sum) + _mm_cvtsd_f64(rest);
+    endgame = _mm512_reduce_add_pd(eg_sum) + _mm_cvtsd_f64(_mm_unpackhi_pd(rest, rest));
+}
+
+// Evaluates 8 entries per block. The gradient updates use the same pair code as AVX2.
+template<bool Gradient>
+TARGET_AVX512 static double sweep_avx512(const DataSegment& segment, const uint64_t begin, const uint64_t end, const double* parameters, const double K, double* gradient)
+{
+    constexpr int width = 8;
+    vector<CoefficientEntry> decoded;
+    const CoefficientEntry* lane_coefficients[width];
+    uint64_t lane_counts[width];
+    alignas(64) double midgames[width];
+    alignas(64) double endgames[width];
+    alignas(64) double phases[width];
+    alignas(64) double additional_scores[width];
+    alignas(64) double wdls[width];
+    alignas(64) double endgame_scales[width];
+    alignas(64) double weights[width];
+    alignas(64) double mg_bases[width];
+    alignas(64) double eg_bases[width];
+
+    __m512d error_sum = _mm512_setzero_pd();
+    const __m512d scale = _mm512_set1_pd(-K / 400);
+    const __m512d one = _mm512_set1_pd(1);
+    const __m512d phase_total = _mm512_set1_pd(24);
+    for (uint64_t block = begin; block < end; block += width)
+    {
+        const auto count = static_cast<int>(min<uint64_t>(width, end - block));
+        load_coefficients(segment, block, count, decoded, lane_coefficients, lane_counts);
+        for (int lane = 0; lane < width; lane++)
+        {
+            if (lane < count)
+            {
+                dot_avx512(lane_coefficients[lane], lane_counts[lane], parameters, midgames[lane], endgames[lane]);
+                load_lane(segment, block + lane, phases, additional_scores, wdls, endgame_scales, weights, lane);
+            }
+            else
+            {
+                clear_lane(midgames, endgames, phases, additional_scores, wdls, endgame_scales, weights, lane);
+            }
+        }
+
+        const __m512d phase = _mm512_load_pd(phases);
+        const __m512d endgame_scale = _mm512_load_pd(endgame_scales);
+        const __m512d endgame = _mm512_mul_pd(_mm512_load_pd(endgames), endgame_scale);
+        const __m512d mixed = _mm512_fmadd_pd(_mm512_load_pd(midgames), phase, _mm512_mul_pd(endgame, _mm512_sub_pd(phase_total, phase)));
+        const __m512d eval = _mm512_add_pd(_mm512_load_pd(additional_scores), _mm512_div_pd(mixed, phase_total));
+        const __m512d sig = _mm512_div_pd(one, _mm512_add_pd(one, exp_avx512(_mm512_mul_pd(scale, eval))));
+        const __m512d diff = _mm512_sub_pd(_mm512_load_pd(wdls), sig);
+        const __m512d weighted_diff = _mm512_mul_pd(diff, _mm512_load_pd(weights));
+        error_sum = _mm512_fmadd_pd(weighted_diff, diff, error_sum);
+
+        if constexpr (Gradient)
+        {
+            const __m512d res = _mm512_mul_pd(_mm512_mul_pd(weighted_diff, sig), _mm512_sub_pd(one, sig));
+            const __m512d mg_base = _mm512_mul_pd(res, _mm512_div_pd(phase, phase_total));
+            _mm512_store_pd(mg_bases, mg_base);
+            _mm512_store_pd(eg_bases, _mm512_mul_pd(_mm512_sub_pd(res, mg_base), endgame_scale));
+            for (int lane = 0; lane < count; lane++)
+            {
+                scatter_gradient_avx2(lane_coefficients[lane], lane_counts[lane], mg_bases[lane], eg_bases[lane], gradient);
+            }
+        }
+    }
+
+    return _mm512_reduce_add_pd(error_sum);
+}
+
+tune_t Kernels::sweep(const KernelType type, const DataSegment& segment, const uint64_t begin, const uint64_t end, const tune_t* parameters, const tune_t K, tune_t* gradient)
+{
+    switch (type)
+    {
+    case KernelType::Avx512:
+        return gradient ? sweep_avx512<true>(segment, begin, end, parameters, K, gradient) : sweep_avx512<false>(segment, begin, end, parameters, K, gradient);
+    case KernelType::Avx2:
+        return gradient ? sweep_avx2<true>(segment, begin, end, parameters, K, gradient) : sweep_avx2<false>(segment, begin, end, parameters, K, gradient);
+    default:
+        throw runtime_error("No vectorized kernel selected");
+    }
+}
+
+#else
+
+tune_t Kernels::sweep(KernelType, const DataSegment&, uint64_t, uint64_t, const tune_t*, tune_t, tune_t*)
+{
+    throw runtime_error("Vectorized kernels are not available in this build");
+}
+
+#endif
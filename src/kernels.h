@@ -0,0 +1,37 @@
+#ifndef KERNELS_H
+#define KERNELS_H 1
+
+#include "base.h"
+#include "config.h"
+#include "dataset.h"
+
+#include <cstdint>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#define KERNELS_X86 1
+#else
+#define KERNELS_X86 0
+#endif
+
+namespace Kernels
+{
+    enum class KernelType
+    {
+        Scalar,
+        Avx2,
+        Avx512
+    };
+
+    // The vectorized kernels read the parameters as interleaved midgame/endgame pairs.
+    // Compressed coefficients are decoded one block of entries at a time before the dot products.
+    constexpr bool simd_supported = enable_simd_kernels && KERNELS_X86 && TAPERED && !SINGLE_PRECISION;
+
+    KernelType detect_kernel();
+    const char* get_kernel_name(KernelType type);
+
+    // Returns the summed squared error of entries [begin, end) of the segment, each weighted by its entry weight.
+    // If gradient is not null, the unscaled weighted gradient of those entries is added to it as well.
+    tune_t sweep(KernelType type, const Tuner::DataSegment& segment, uint64_t begin, uint64_t end, const tune_t* parameters, tune_t K, tune_t* gradient);
+}
+
+#endif // !KERNELS_H
@@ -10,6 +10,22 @@ using namespace std;
 using namespace Tuner;
 
 int main(int argc, char** argv) {
+    // tuner --check-trace [position count] [seed]
+    if (argc > 1 && string(argv[1]) == "--check-trace")
+    {
+        try
+        {
+            const int64_t position_count = argc > 2 ? stoll(argv[2]) : 1000000;
+            const uint64_t seed = argc > 3 ? stoull(argv[3]) : 1;
+            return check_traces(position_count, seed) ? 0 : 1;
+        }
+        catch (const std::logic_error&)
+        {
+            cout << "Usage: " << argv[0] << " --check-trace [position count] [seed]" << endl;
+            return -1;
+        }
+    }
+
     vector<DataSource> sources;
     {
         string csv_path = "sources.csv";
@@ -83,7 +99,76 @@ int main(int argc, char** argv) {
         return -1;
     }
 
-    run(sources);
+    // Optional run list, one run per line. Empty or missing columns keep the value from config.h.
+    vector<RunConfig> runs;
+    if (argc > 2)
+    {
+        const string runs_path = argv[2];
+        ifstream csv(runs_path);
+        if (!csv)
+        {
+            cout << "Unable to open run list " << runs_path << endl;
+            return -1;
+        }
+
+        string line;
+        while (getline(csv, line))
+        {
+            if (line.empty() || line.starts_with('#'))
+            {
+                continue;
+            }
+
+            auto run = get_default_run_config();
+            run.name = "run " + to_string(runs.size() + 1);
+            stringstream ss(line);
+            string field;
+            for (int column = 0; getline(ss, field, ','); column++)
+            {
+                const auto first = field.find_first_not_of(" \t\r");
+                if (first == string::npos)
+                {
+                    continue;
+                }
+                field = field.substr(first, field.find_last_not_of(" \t\r") - first + 1);
+
+                try
+                {
+                    switch (column)
+                    {
+                    case 0: run.name = field; break;
+                    case 1: run.initial_learning_rate = stod(field); break;
+                    case 2: run.learning_rate_drop_interval = stoi(field); break;
+                    case 3: run.learning_rate_drop_ratio = stod(field); break;
+                    case 4: run.preferred_k = stod(field); break;
+                    case 5: run.max_epoch = stoi(field); break;
+                    default:
+                        cout << "Run list misformatted, too many columns in: " << line << endl;
+                        return -1;
+                    }
+                }
+                catch (const std::logic_error&)
+                {
+                    cout << field << " is not a valid value in column " << column + 1 << " of the run list" << endl;
+                    return -1;
+                }
+            }
+
+            if (run.learning_rate_drop_interval <= 0 || run.max_epoch <= 0)
+            {
+                cout << "Run " << run.name << " needs a positive learning rate drop interval and epoch count" << endl;
+                return -1;
+            }
+            runs.push_back(run);
+        }
+    }
+
+    if (runs.empty())
+    {
+        runs.push_back(get_default_run_config());
+    }
+
+    run(sources, runs);
 
     return 0;
 }
\ No newline at end of file
@@ -1,19 +1,144 @@
 #include "threadpool.h"
 
 #include <cstdint>
+#include <iostream>
 #include <thread>
 
+#if defined(__linux__)
+#include <sched.h>
+#endif
+
+#if HAS_LIBNUMA
+#include <numa.h>
+#endif
+
 using namespace std;
 
-void ThreadPool::start(uint32_t thread_count)
+static thread_local uint32_t current_worker_index = 0;
+
+// Returns the CPU for each worker, spreading the workers over the NUMA nodes in contiguous blocks.
+// Without libnuma, the workers are assigned round-robin to the CPUs the process may run on. Empty if pinning is not supported.
+static vector<int> get_worker_cpus(const uint32_t thread_count)
+{
+    vector<int> cpus;
+#if HAS_LIBNUMA
+    if (numa_available() >= 0)
+    {
+        const auto node_count = numa_num_configured_nodes();
+        vector<vector<int>> node_cpus(node_count);
+        for (int cpu = 0; cpu < numa_num_configured_cpus(); cpu++)
+        {
+            const auto node = numa_node_of_cpu(cpu);
+            if (node >= 0 && node < node_count && numa_bitmask_isbitset(numa_all_cpus_ptr, cpu))
+            {
+                node_cpus[node].push_back(cpu);
+            }
+        }
+
+        for (uint32_t worker = 0; worker < thread_count; worker++)
+        {
+            const auto node = worker * node_count / thread_count;
+            const auto first_worker = (node * thread_count + node_count - 1) / node_count;
+            const auto& available = node_cpus[node].empty() ? node_cpus[0] : node_cpus[node];
+            if (available.empty())
+            {
+                return {};
+            }
+            cpus.push_back(available[(worker - first_worker) % available.size()]);
+        }
+        return cpus;
+    }
+#endif
+
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0)
+    {
+        return {};
+    }
+
+    vector<int> allowed_cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+    {
+        if (CPU_ISSET(cpu, &allowed))
+        {
+            allowed_cpus.push_back(cpu);
+        }
+    }
+    if (allowed_cpus.empty())
+    {
+        return {};
+    }
+
+    for (uint32_t worker = 0; worker < thread_count; worker++)
+    {
+        cpus.push_back(allowed_cpus[worker % allowed_cpus.size()]);
+    }
+#endif
+    return cpus;
+}
+
+static void pin_current_thread(const int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t cpu_set;
+    CPU_ZERO(&cpu_set);
+    CPU_SET(cpu, &cpu_set);
+    sched_setaffinity(0, sizeof(cpu_set), &cpu_set);
+#endif
+#if HAS_LIBNUMA
+    if (numa_available() >= 0)
+    {
+        // Memory first touched by this worker comes from its own node
+        numa_set_localalloc();
+    }
+#endif
+}
+
+void ThreadPool::start(uint32_t thread_count, bool pin_threads)
 {
     stop();
     should_stop = false;
-    for (int thread_index = 0; thread_index < thread_count; thread_index++)
+    for (uint32_t thread_index = 0; thread_index < thread_count; thread_index++)
+    {
+        queues.push_back(make_unique<WorkerQueue>());
+    }
+    ranges = vector<StealableRange>(thread_count);
+    finish_times.assign(thread_count, chrono::steady_clock::time_point{});
+    worker_ran.assign(thread_count, 0);
+    processed_counts.assign(thread_count, 0);
+
+    vector<int> cpus;
+    if (pin_threads)
+    {
+        cpus = get_worker_cpus(thread_count);
+        if (cpus.empty())
+        {
+            cout << "Thread pinning is not supported on this platform" << endl;
+        }
+        else
+        {
+#if HAS_LIBNUMA
+            const auto node_count = numa_available() >= 0 ? numa_num_configured_nodes() : 1;
+#else
+            const auto node_count = 1;
+#endif
+            cout << "Pinning " << thread_count << " threads over " << node_count << " NUMA node(s)" << endl;
+        }
+    }
+
+    for (uint32_t thread_index = 0; thread_index < thread_count; thread_index++)
     {
-        threads.emplace_back([this]()
+        const auto cpu = cpus.empty() ? -1 : cpus[thread_index];
+        threads.emplace_back([this, thread_index, cpu]()
         {
-            thread_loop();
+            current_worker_index = thread_index;
+            if (cpu >= 0)
+            {
+                pin_current_thread(cpu);
+            }
+            thread_loop(thread_index);
         });
     }
 }
@@ -24,10 +149,27 @@ uint32_t ThreadPool::thread_count() const
 }
 
 void ThreadPool::enqueue(const function<void()>& job)
+{
+    uint32_t worker_index;
+    {
+        unique_lock<mutex> lock(queue_mutex);
+        worker_index = next_queue;
+        next_queue = (next_queue + 1) % queues.size();
+    }
+    enqueue_to(worker_index, job);
+}
+
+// Queues the job for a specific worker, other workers only run it if they run out of work
+void ThreadPool::enqueue_to(uint32_t worker_index, const function<void()>& job)
 {
     {
         unique_lock<mutex> lock(queue_mutex);
-        jobs.push(job);
+        auto& queue = *queues[worker_index % queues.size()];
+        {
+            lock_guard queue_lock(queue.mutex);
+            queue.jobs.push_back(job);
+        }
+        pending_job_count++;
     }
     mutex_condition.notify_one();
 }
@@ -46,36 +188,74 @@ void ThreadPool::stop()
         active_thread.join();
     }
     threads.clear();
+    queues.clear();
+    pending_job_count = 0;
+    next_queue = 0;
 }
 
 bool ThreadPool::is_idle()
 {
     unique_lock<mutex> lock(queue_mutex);
-    return jobs.empty() && running_job_count == 0;
+    return pending_job_count == 0 && running_job_count == 0;
 }
 
 void ThreadPool::wait_for_completion()
 {
     unique_lock<mutex> lock(queue_mutex);
-    while(!jobs.empty() || running_job_count > 0)
+    completion_condition.wait(lock, [this]
     {
-        completion_condition.wait(lock, [this]
+        return pending_job_count == 0 && running_job_count == 0;
+    });
+}
+
+uint32_t ThreadPool::worker_index()
+{
+    return current_worker_index;
+}
+
+const ParallelStats& ThreadPool::get_last_stats() const
+{
+    return last_stats;
+}
+
+// Takes a job from the worker's own queue, or steals the oldest job of another worker.
+// Stealing ignores NUMA nodes: a worker that reserved a job must find one, and the pending count is not kept per node.
+function<void()> ThreadPool::take_job(uint32_t worker_index)
+{
+    for (size_t offset = 0; offset < queues.size(); offset++)
+    {
+        auto& queue = *queues[(worker_index + offset) % queues.size()];
+        lock_guard lock(queue.mutex);
+        if (queue.jobs.empty())
         {
-            return jobs.empty() && running_job_count == 0;
-        });
+            continue;
+        }
+
+        function<void()> job;
+        if (offset == 0)
+        {
+            job = std::move(queue.jobs.back());
+            queue.jobs.pop_back();
+        }
+        else
+        {
+            job = std::move(queue.jobs.front());
+            queue.jobs.pop_front();
+        }
+        return job;
     }
+    return nullptr;
 }
 
-void ThreadPool::thread_loop()
+void ThreadPool::thread_loop(uint32_t worker_index)
 {
     while (true)
     {
-        function<void()> job;
         {
             unique_lock<mutex> lock(queue_mutex);
             mutex_condition.wait(lock, [this]
             {
-                return !jobs.empty() || should_stop;
+                return pending_job_count > 0 || should_stop;
             });
 
             if (should_stop)
@@ -83,11 +263,17 @@ void ThreadPool::thread_loop()
                 return;
             }
 
-            job = jobs.front();
-            jobs.pop();
+            // Reserves one of the queued jobs for this worker
+            pending_job_count--;
             running_job_count++;
         }
 
+        function<void()> job;
+        while (!job)
+        {
+            job = take_job(worker_index);
+        }
+
         job();
 
         {
@@ -1,31 +1,242 @@
 #ifndef THREADPOOL_H
 #define THREADPOOL_H 1
 
+#include <algorithm>
+#include <chrono>
 #include <condition_variable>
+#include <cstdint>
+#include <deque>
 #include <functional>
+#include <memory>
 #include <mutex>
 #include <queue>
+#include <stdexcept>
+#include <string>
 #include <thread>
+#include <type_traits>
+#include <vector>
+
+// Half-open range of 64-bit indices [begin, end)
+struct IndexRange
+{
+    uint64_t begin;
+    uint64_t end;
+};
+
+// Splits [begin, end) into part_count contiguous parts that differ in size by at most one and together cover every index exactly once.
+// The first (end - begin) % part_count parts get the extra index. Does not overflow for any range that fits in uint64_t.
+inline IndexRange get_partition(const uint64_t begin, const uint64_t end, const uint64_t part_index, const uint64_t part_count)
+{
+    const auto total = end - begin;
+    const auto base_size = total / part_count;
+    const auto remainder = total % part_count;
+    const auto part_begin = begin + part_index * base_size + std::min(part_index, remainder);
+    const auto part_size = base_size + (part_index < remainder ? 1 : 0);
+    return { part_begin, part_begin + part_size };
+}
+
+// Timing of the most recent parallel_for, used to report how long the slowest worker held up the others
+struct ParallelStats
+{
+    double duration_ms = 0;
+    double first_finish_ms = 0;
+};
 
 class ThreadPool {
 public:
-    void start(uint32_t thread_count);
+    // With pin_threads, every worker is bound to its own core, spread evenly over the NUMA nodes.
+    // Jobs and chunks are still stolen across nodes, so NUMA placement of the work is best-effort.
+    void start(uint32_t thread_count, bool pin_threads = false);
     uint32_t thread_count() const;
     void enqueue(const std::function<void()>& job);
     void stop();
     bool is_idle();
     void wait_for_completion();
+    const ParallelStats& get_last_stats() const;
+
+    // Index of the pool worker running the calling thread
+    static uint32_t worker_index();
+
+    // Calls func(chunk_begin, chunk_end, worker_index) for chunks of at most grain_size indices covering [begin, end).
+    // Worker i starts on the i-th contiguous share of the range, the same share in every call, and steals chunks from the back
+    // of the others' shares once it runs out. A grain size of 0 gives every worker exactly its share, unless a worker never starts.
+    // At most job_count workers take part, 0 means all of them.
+    // The bookkeeping is kept in the pool between calls, so only one parallel_for may run at a time and it must not be nested.
+    template<typename F>
+    void parallel_for(const uint64_t begin, const uint64_t end, const uint64_t grain_size, F&& func, uint32_t job_count = 0)
+    {
+        const auto worker_count = thread_count();
+        if (job_count == 0 || job_count > worker_count)
+        {
+            job_count = worker_count;
+        }
+
+        for (uint32_t share_index = 0; share_index < worker_count; share_index++)
+        {
+            const auto share = share_index < job_count ? get_partition(begin, end, share_index, job_count) : IndexRange{ 0, 0 };
+            auto& range = ranges[share_index];
+            range.begin = share.begin;
+            range.end = share.end;
+        }
+
+        const auto start_time = std::chrono::steady_clock::now();
+        std::fill(finish_times.begin(), finish_times.end(), start_time);
+        std::fill(worker_ran.begin(), worker_ran.end(), 0);
+        std::fill(processed_counts.begin(), processed_counts.end(), 0);
+
+        // The jobs only capture two pointers, so std::function stores them without allocating
+        struct Context
+        {
+            uint64_t grain_size;
+            std::remove_reference_t<F>* func;
+        };
+        Context context{ grain_size, &func };
+        for (uint32_t job_index = 0; job_index < job_count; job_index++)
+        {
+            enqueue_to(job_index, [this, &context]()
+            {
+                run_chunks(context.grain_size, *context.func);
+            });
+        }
+
+        wait_for_completion();
+
+        uint64_t processed_count = 0;
+        for (const auto count : processed_counts)
+        {
+            processed_count += count;
+        }
+        if (processed_count != end - begin)
+        {
+            throw std::runtime_error("parallel_for processed " + std::to_string(processed_count) + " of " + std::to_string(end - begin) + " indices");
+        }
+
+        auto first_finish = std::chrono::steady_clock::time_point::max();
+        auto last_finish = start_time;
+        for (uint32_t worker = 0; worker < worker_count; worker++)
+        {
+            if (worker_ran[worker])
+            {
+                first_finish = std::min(first_finish, finish_times[worker]);
+                last_finish = std::max(last_finish, finish_times[worker]);
+            }
+        }
+        last_stats.duration_ms = std::chrono::duration<double, std::milli>(last_finish - start_time).count();
+        last_stats.first_finish_ms = std::chrono::duration<double, std::milli>(std::min(first_finish, last_finish) - start_time).count();
+    }
+
+    // Runs func(chunk_begin, chunk_end, partial) like parallel_for, with one partial result per worker starting from identity.
+    // Each partial is created by the worker using it, so it is normally allocated on that worker's NUMA node.
+    // The partials are then merged in worker order with combine(total, partial).
+    template<typename T, typename F, typename R>
+    T parallel_reduce(const uint64_t begin, const uint64_t end, const uint64_t grain_size, const T& identity, F&& func, R&& combine, const uint32_t job_count = 0)
+    {
+        std::vector<std::unique_ptr<T>> partials(thread_count());
+        parallel_for(begin, end, grain_size, [&partials, &identity, &func](const uint64_t chunk_begin, const uint64_t chunk_end, const uint32_t worker)
+        {
+            if (!partials[worker])
+            {
+                partials[worker] = std::make_unique<T>(identity);
+            }
+            func(chunk_begin, chunk_end, *partials[worker]);
+        }, job_count);
+
+        T total = identity;
+        for (auto& partial : partials)
+        {
+            if (partial)
+            {
+                combine(total, *partial);
+            }
+        }
+        return total;
+    }
 
 private:
+    struct WorkerQueue
+    {
+        std::mutex mutex;
+        std::deque<std::function<void()>> jobs;
+    };
+
+    struct alignas(64) StealableRange
+    {
+        std::mutex mutex;
+        uint64_t begin = 0;
+        uint64_t end = 0;
+    };
+
     bool should_stop = false;
+    uint32_t pending_job_count = 0;
     uint32_t running_job_count = 0;
+    uint32_t next_queue = 0;
     std::mutex queue_mutex;
     std::condition_variable mutex_condition;
     std::condition_variable completion_condition;
     std::vector<std::thread> threads;
-    std::queue<std::function<void()>> jobs;
+    std::vector<std::unique_ptr<WorkerQueue>> queues;
+    ParallelStats last_stats;
+
+    std::vector<StealableRange> ranges;
+    std::vector<std::chrono::steady_clock::time_point> finish_times;
+    std::vector<uint8_t> worker_ran;
+    std::vector<uint64_t> processed_counts;
+
+    void thread_loop(uint32_t worker_index);
+    std::function<void()> take_job(uint32_t worker_index);
+    void enqueue_to(uint32_t worker_index, const std::function<void()>& job);
+
+    template<typename F>
+    void run_chunks(const uint64_t grain_size, F& func)
+    {
+        const auto worker_count = thread_count();
+        const auto current_worker = worker_index();
+        uint64_t chunk_begin;
+        uint64_t chunk_end;
+        while (take_chunk(ranges[current_worker], grain_size, false, chunk_begin, chunk_end))
+        {
+            func(chunk_begin, chunk_end, current_worker);
+            processed_counts[current_worker] += chunk_end - chunk_begin;
+        }
+
+        for (uint32_t offset = 1; offset < worker_count; offset++)
+        {
+            auto& victim = ranges[(current_worker + offset) % worker_count];
+            while (take_chunk(victim, grain_size, true, chunk_begin, chunk_end))
+            {
+                func(chunk_begin, chunk_end, current_worker);
+                processed_counts[current_worker] += chunk_end - chunk_begin;
+            }
+        }
+
+        finish_times[current_worker] = std::chrono::steady_clock::now();
+        worker_ran[current_worker] = 1;
+    }
+
+    // Owners take chunks from the front of their range, thieves from the back
+    static bool take_chunk(StealableRange& range, const uint64_t grain_size, const bool steal, uint64_t& chunk_begin, uint64_t& chunk_end)
+    {
+        std::lock_guard lock(range.mutex);
+        if (range.begin >= range.end)
+        {
+            return false;
+        }
 
-    void thread_loop();
+        const auto chunk_size = grain_size == 0 ? range.end - range.begin : std::min(grain_size, range.end - range.begin);
+        if (steal)
+        {
+            chunk_end = range.end;
+            chunk_begin = range.end - chunk_size;
+            range.end = chunk_begin;
+        }
+        else
+        {
+            chunk_begin = range.begin;
+            chunk_end = range.begin + chunk_size;
+            range.begin = chunk_end;
+        }
+        return true;
+    }
 };
 
 #endif // !THREADPOOL_H
@@ -1,16 +1,31 @@
 #include "tuner.h"
 #include "base.h"
+#include "checkpoint.h"
 #include "config.h"
+#include "dataset.h"
+#include "kernels.h"
 #include "threadpool.h"
 #include "external/chess.hpp"
 
+#include <algorithm>
 #include <array>
+#include <atomic>
 #include <chrono>
 #include <cmath>
+#include <condition_variable>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
 #include <fstream>
 #include <iostream>
-#include <sstream>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <queue>
+#include <random>
+#include <span>
 #include <stdexcept>
+#include <string_view>
 #include <thread>
 #include <vector>
 
@@ -24,25 +39,6 @@ struct WdlMarker
     tune_t wdl;
 };
 
-struct CoefficientEntry
-{
-    int16_t value;
-    int16_t index;
-};
-
-struct Entry
-{
-    vector<CoefficientEntry> coefficients;
-    tune_t wdl;
-    bool white_to_move;
-    //tune_t initial_eval;
-    tune_t additional_score;
-#if TAPERED
-    int32_t phase;
-    tune_t endgame_scale;
-#endif
-};
-
 static const array<WdlMarker, 4> markers
 {
     WdlMarker{"1.0", 1},
@@ -52,61 +48,124 @@ static const array<WdlMarker, 4> markers
     WdlMarker{"0-1", 0}
 };
 
-static tune_t get_fen_wdl(const string& original_fen, const bool original_white_to_move, const bool white_to_move, const bool side_to_move_wdl)
+// A data line split into the parts the tuner needs, fen is a view into the line
+struct ParsedLine
 {
+    string_view fen;
+    bool white_to_move;
     tune_t wdl;
-    bool marker_found = false;
-    for (auto& marker : markers)
+};
+
+static bool is_line_separator(const char c)
+{
+    switch (c)
     {
-        if (original_fen.find(marker.marker) != std::string::npos)
-        {
-            if (marker_found)
-            {
-                cout << "WDL marker already found on line " << original_fen << endl;
-                throw std::runtime_error("WDL marker already found");
-            }
-            marker_found = true;
-            wdl = marker.wdl;
-        }
+    case ' ':
+    case '\t':
+    case '\r':
+    case ';':
+    case ',':
+    case '[':
+    case ']':
+    case '"':
+        return true;
+    default:
+        return false;
     }
+}
 
-    if(!marker_found)
+// Single pass over the line without allocating. The first four fields are the FEN (placement, side to move, castling, en passant),
+// the remaining fields are searched for a WDL marker or, failing that, a probability like 0.6.
+static ParsedLine parse_line(const string_view line, const bool side_to_move_wdl)
+{
+    ParsedLine parsed{};
+    int32_t field_count = 0;
+    const WdlMarker* found_marker = nullptr;
+    bool probability_found = false;
+    tune_t probability = 0;
+
+    size_t position = 0;
+    while (position < line.size())
     {
-        stringstream ss(original_fen);
-        while (!ss.eof())
+        while (position < line.size() && is_line_separator(line[position]))
+        {
+            position++;
+        }
+        const auto field_begin = position;
+        while (position < line.size() && !is_line_separator(line[position]))
+        {
+            position++;
+        }
+        if (field_begin == position)
         {
-            string word;
-            ss >> word;
-            if (word.starts_with("0."))
+            break;
+        }
+
+        const auto field = line.substr(field_begin, position - field_begin);
+        field_count++;
+        if (field_count <= 4)
+        {
+            if (field_count == 2)
             {
-                wdl = stod(word);
-                marker_found = true;
+                parsed.white_to_move = field == "w";
             }
-            else if (word.starts_with("[0."))
+            if (field_count == 4)
+            {
+                parsed.fen = line.substr(0, position);
+            }
+            continue;
+        }
+
+        bool is_marker = false;
+        for (const auto& marker : markers)
+        {
+            if (field == marker.marker)
             {
-                wdl = stod(word.substr(1, word.size() - 2));
-                marker_found = true;
+                if (found_marker != nullptr && found_marker != &marker)
+                {
+                    cout << "WDL marker already found on line " << line << endl;
+                    throw std::runtime_error("WDL marker already found");
+                }
+                found_marker = &marker;
+                is_marker = true;
             }
         }
+
+        if (!is_marker && field.starts_with("0.") && field.size() < 32)
+        {
+            array<char, 32> number{};
+            copy(field.begin(), field.end(), number.begin());
+            probability = static_cast<tune_t>(strtod(number.data(), nullptr));
+            probability_found = true;
+        }
     }
 
-    if (!marker_found)
+    if (field_count < 4)
     {
-        cout << "WDL marker not found on line " << original_fen << endl;
-        throw std::runtime_error("WDL marker not found");
+        cout << "Invalid FEN on line " << line << endl;
+        throw std::runtime_error("Invalid FEN");
     }
 
-    if(!original_white_to_move && side_to_move_wdl)
+    if (found_marker != nullptr)
     {
-        wdl = 1 - wdl;
+        parsed.wdl = found_marker->wdl;
+    }
+    else if (probability_found)
+    {
+        parsed.wdl = probability;
+    }
+    else
+    {
+        cout << "WDL marker not found on line " << line << endl;
+        throw std::runtime_error("WDL marker not found");
     }
 
-    return wdl;
-}   
+    if (!parsed.white_to_move && side_to_move_wdl)
+    {
+        parsed.wdl = 1 - parsed.wdl;
+    }
 
-static bool get_fen_color_to_move(const string& fen)
-{
-    return fen.find('w') != std::string::npos;
+    return parsed;
 }
 
 static void print_elapsed(high_resolution_clock::time_point start)
@@ -117,6 +176,7 @@ static void print_elapsed(high_resolution_clock::time_point start)
     cout << "[" << elapsed_seconds << "s] ";
 }
 
+// Adapts the dense interface: appends the non-zero coefficients
 static void get_coefficient_entries(const coefficients_t& coefficients, vector<CoefficientEntry>& coefficient_entries, int32_t parameter_count)
 {
     if(coefficients.size() != parameter_count)
@@ -136,20 +196,22 @@ static void get_coefficient_entries(const coefficients_t& coefficients, vector<C
     }
 }
 
-static tune_t linear_eval(const Entry& entry, const parameters_t& parameters)
+// Works on both Entry and EntryMetadata, which share the fields used here, and on plain or packed coefficients.
+// The terms are added to score, which is the additional score of the entry unless given.
+template<typename C, typename T>
+static tune_t linear_eval(const C& coefficients, const T& entry, const parameters_t& parameters, tune_t score)
 {
-    tune_t score = entry.additional_score;
 #if TAPERED 
     tune_t midgame = 0;
     tune_t endgame = 0;
-    for (const auto& coefficient : entry.coefficients)
+    for (const auto& coefficient : coefficients)
     {
         midgame += coefficient.value * parameters[coefficient.index][static_cast<int32_t>(PhaseStages::Midgame)];
         endgame += coefficient.value * parameters[coefficient.index][static_cast<int32_t>(PhaseStages::Endgame)] * entry.endgame_scale;
     }
     score += (midgame * entry.phase + endgame * (24 - entry.phase)) / 24;
 #else
-    for (const auto& coefficient : entry.coefficients)
+    for (const auto& coefficient : coefficients)
     {
         score += coefficient.value * parameters[coefficient.index];
     }
@@ -158,6 +220,17 @@ static tune_t linear_eval(const Entry& entry, const parameters_t& parameters)
     return score;
 }
 
+template<typename C, typename T>
+static tune_t linear_eval(const C& coefficients, const T& entry, const parameters_t& parameters)
+{
+    return linear_eval(coefficients, entry, parameters, entry.additional_score);
+}
+
+static tune_t linear_eval(const Entry& entry, const parameters_t& parameters)
+{
+    return linear_eval(entry.coefficients, entry, parameters);
+}
+
 static int32_t get_phase(const string& fen)
 {
     int32_t phase = 0;
@@ -206,37 +279,35 @@ static int32_t get_phase(const string& fen)
     return phase;
 }
 
+// Phase weight of a piece type, the same weights get_phase counts
+static int32_t get_phase_value(const chess::PieceType type)
+{
+    if (type == chess::PieceType::KNIGHT || type == chess::PieceType::BISHOP)
+    {
+        return 1;
+    }
+    if (type == chess::PieceType::ROOK)
+    {
+        return 2;
+    }
+    if (type == chess::PieceType::QUEEN)
+    {
+        return 4;
+    }
+    return 0;
+}
+
 static int32_t get_phase(const chess::Board& board)
 {
     int32_t phase = 0;
-
-    for(uint8_t square_num = 0; square_num < 64; ++square_num)
+    for (const auto type : { chess::PieceType::KNIGHT, chess::PieceType::BISHOP, chess::PieceType::ROOK, chess::PieceType::QUEEN })
     {
-        const auto square = static_cast<chess::Square>(square_num);
-        const auto piece = board.at(square);
-        switch (piece)
-        {
-        case chess::Piece(chess::Piece::WHITEKNIGHT):
-        case chess::Piece(chess::Piece::WHITEBISHOP):
-        case chess::Piece(chess::Piece::BLACKKNIGHT):
-        case chess::Piece(chess::Piece::BLACKBISHOP):
-            phase += 1;
-            break;
-        case chess::Piece(chess::Piece::WHITEROOK):
-        case chess::Piece(chess::Piece::BLACKROOK):
-            phase += 2;
-            break;
-        case chess::Piece(chess::Piece::WHITEQUEEN):
-        case chess::Piece(chess::Piece::BLACKQUEEN):
-            phase += 4;
-            break;
-        }
+        phase += get_phase_value(type) * board.pieces(type).count();
     }
-
     return phase;
 }
 
-static void print_statistics(const parameters_t& parameters, const vector<Entry>& entries)
+static void print_statistics(const parameters_t& parameters, const EntryStore& entries)
 {
     array<size_t, 2> wins{};
     array<size_t, 2> draws{};
@@ -248,53 +319,69 @@ static void print_statistics(const parameters_t& parameters, const vector<Entry>
     size_t max_parameters = 0;
     size_t total_parameters = 0;
 
-    for(auto& entry : entries)
+    for (const auto& segment : entries.get_segments())
     {
-        if(entry.wdl == 1)
-        {
-            wins[entry.white_to_move]++;
-        }
-        else if(entry.wdl == 0.5)
-        {
-            draws[entry.white_to_move]++;
-        }
-        else if (entry.wdl == 0.0)
+        for (uint64_t i = 0; i < segment.size; i++)
         {
-            losses[entry.white_to_move]++;
-        }
-        total[entry.white_to_move]++;
-        wdls[entry.white_to_move] += entry.wdl;
+            const auto& entry = segment.metadata[i];
+            size_t coefficient_count = 0;
+            for ([[maybe_unused]] const auto& coefficient : segment.get_coefficients(i))
+            {
+                coefficient_count++;
+            }
+            // Merged entries with a mixed mean result count towards the totals and averages only
+            if(entry.wdl == 1)
+            {
+                wins[entry.white_to_move] += entry.weight;
+            }
+            else if(entry.wdl == 0.5)
+            {
+                draws[entry.white_to_move] += entry.weight;
+            }
+            else if (entry.wdl == 0.0)
+            {
+                losses[entry.white_to_move] += entry.weight;
+            }
+            total[entry.white_to_move] += entry.weight;
+            wdls[entry.white_to_move] += entry.wdl * entry.weight;
 
-        if(entry.coefficients.size() < min_parameters)
-        {
-            min_parameters = entry.coefficients.size();
-        }
+            if(coefficient_count < min_parameters)
+            {
+                min_parameters = coefficient_count;
+            }
 
-        if (entry.coefficients.size() > max_parameters)
-        {
-            max_parameters = entry.coefficients.size();
-        }
+            if (coefficient_count > max_parameters)
+            {
+                max_parameters = coefficient_count;
+            }
 
-        total_parameters += entry.coefficients.size();
+            total_parameters += coefficient_count * entry.weight;
+        }
     }
 
+    const auto position_count = entries.total_weight();
     cout << "Dataset statistics:" << endl;
-    cout << "Total positions: " << entries.size() << endl;
+    cout << "Total positions: " << position_count << endl;
+    if (position_count != entries.size())
+    {
+        cout << "Unique entries: " << entries.size() << endl;
+    }
     for(int color = 1; color >= 0; color--)
     {
         const auto color_name = color ? "White" : "Black";
-        cout << color_name << ": " << total[color] << " (" << (total[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 1.0: " << wins[color] << " (" << (wins[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 0.5: " << draws[color] << " (" << (draws[color] * 100.0 / entries.size()) << "%)" << endl;
-        cout << color_name << " 0.0: " << losses[color] << " (" << (losses[color] * 100.0 / entries.size()) << "%)" << endl;
+        cout << color_name << ": " << total[color] << " (" << (total[color] * 100.0 / position_count) << "%)" << endl;
+        cout << color_name << " 1.0: " << wins[color] << " (" << (wins[color] * 100.0 / position_count) << "%)" << endl;
+        cout << color_name << " 0.5: " << draws[color] << " (" << (draws[color] * 100.0 / position_count) << "%)" << endl;
+        cout << color_name << " 0.0: " << losses[color] << " (" << (losses[color] * 100.0 / position_count) << "%)" << endl;
         cout << color_name << " avg: " << wdls[color] / total[color] << endl;
     }
 
-    auto avg_parameters = static_cast<tune_t>(total_parameters) / entries.size();
+    auto avg_parameters = static_cast<tune_t>(total_parameters) / position_count;
     cout << "Parameters total: " << parameters.size() << endl;
     cout << "Parameters min: " << min_parameters << endl;
     cout << "Parameters max: " << max_parameters << endl;
     cout << "Parameters avg: " << avg_parameters << endl;
+    cout << "Coefficient storage: " << entries.pool_size() * sizeof(coefficient_pool_t) << " bytes" << (compress_coefficients ? " (compressed)" : "") << endl;
 
     cout << endl;
 }
@@ -307,6 +394,13 @@ struct PvEntry
 };
 using pv_table_t = array<PvEntry, 64>;
 
+// Buffers of the quiescence search for one loading thread, reused for every position so that searching does not allocate
+struct QsearchScratch
+{
+    pv_table_t pv_table{};
+    int64_t nodes = 0;
+};
+
 static int32_t get_piece_value(const chess::Piece piece)
 {
     switch (piece)
@@ -356,33 +450,150 @@ static int32_t mvv_lva(const chess::Board& board, const chess::Move move)
     return score;
 }
 
-static tune_t quiescence(chess::Board& board, const parameters_t& parameters, pv_table_t& pv_table, tune_t alpha, tune_t beta, const int32_t ply)
+// Compares a sparse trace with the dense coefficients of the same position
+// Compares the sparse trace with the coefficients, score and endgame scale of get_fen_eval_result
+static bool trace_matches(const string& fen, const SparseTrace& trace, const int32_t parameter_count)
 {
-    pv_table[ply].length = 0;
+    const auto eval_result = TuneEval::get_fen_eval_result(fen);
+    vector<CoefficientEntry> expected;
+    get_coefficient_entries(eval_result.coefficients, expected, parameter_count);
+    auto matches = expected.size() == trace.coefficients.size() && eval_result.score == trace.score && eval_result.endgame_scale == trace.endgame_scale;
+    for (size_t i = 0; matches && i < expected.size(); i++)
+    {
+        matches = expected[i].index == trace.coefficients[i].index && expected[i].value == trace.coefficients[i].value;
+    }
+    return matches;
+}
+
+static void verify_trace(const string& fen, const SparseTrace& trace, const int32_t parameter_count)
+{
+    if (!trace_matches(fen, trace, parameter_count))
+    {
+        throw runtime_error("Sparse trace differs from the dense coefficients for " + fen);
+    }
+}
+
+// Fills trace with the coefficients of the position, through the sparse interface if the evaluation has one.
+// A template on the evaluation, so the discarded branches do not need evaluations without a sparse trace to declare its functions.
+template<typename Eval = TuneEval>
+static void get_trace(const chess::Board& board, SparseTrace& trace, const int32_t parameter_count)
+{
+    trace.clear();
+    if constexpr (Eval::supports_sparse_trace)
+    {
+        if constexpr (Eval::supports_external_chess_eval)
+        {
+            Eval::get_external_trace(board, trace);
+        }
+        else
+        {
+            Eval::get_fen_trace(board.getFen(), trace);
+        }
+        if (!trace.coefficients.empty() && trace.coefficients.back().index >= parameter_count)
+        {
+            throw runtime_error("Parameter count mismatch");
+        }
+        if constexpr (verify_sparse_trace)
+        {
+            verify_trace(board.getFen(), trace, parameter_count);
+        }
+        return;
+    }
 
     EvalResult eval_result;
-    if constexpr (TuneEval::supports_external_chess_eval)
+    if constexpr (Eval::supports_external_chess_eval)
     {
-        eval_result = TuneEval::get_external_eval_result(board);
+        eval_result = Eval::get_external_eval_result(board);
     }
     else
     {
         auto fen = board.getFen();
-        eval_result = TuneEval::get_fen_eval_result(fen);
+        eval_result = Eval::get_fen_eval_result(fen);
     }
+    get_coefficient_entries(eval_result.coefficients, trace.coefficients, parameter_count);
+    trace.score = eval_result.score;
+    trace.endgame_scale = eval_result.endgame_scale;
+}
 
-    Entry entry;
-    entry.white_to_move = board.sideToMove() == chess::Color::WHITE;
-#if TAPERED
-    entry.endgame_scale = eval_result.endgame_scale;
-#endif
-    get_coefficient_entries(eval_result.coefficients, entry.coefficients, static_cast<int32_t>(parameters.size()));
+bool Tuner::check_traces(const int64_t position_count, const uint64_t seed)
+{
+    if constexpr (!TuneEval::supports_sparse_trace)
+    {
+        cout << "The evaluation has no sparse trace to check" << endl;
+        return true;
+    }
+
+    // Random playouts from the start position, restarted when a game ends or gets long,
+    // so checks, castling, en passant, promotions and bare endgames all come up
+    constexpr int32_t max_playout_plies = 300;
+    const auto parameter_count = static_cast<int32_t>(TuneEval::get_initial_parameters().size());
+    mt19937_64 generator(seed);
+    chess::Board board;
+    chess::Movelist moves;
+    SparseTrace trace;
+    int32_t ply = 0;
+    int64_t mismatch_count = 0;
+    for (int64_t position = 0; position < position_count; position++)
+    {
+        chess::movegen::legalmoves(moves, board);
+        if (moves.empty() || ply >= max_playout_plies || board.isHalfMoveDraw() || board.isInsufficientMaterial())
+        {
+            board = chess::Board();
+            ply = 0;
+            chess::movegen::legalmoves(moves, board);
+        }
+        board.makeMove(moves[static_cast<int>(generator() % moves.size())]);
+        ply++;
+
+        get_trace(board, trace, parameter_count);
+        const auto fen = board.getFen();
+        if (!trace_matches(fen, trace, parameter_count))
+        {
+            mismatch_count++;
+            if (mismatch_count <= 10)
+            {
+                cout << "Sparse trace differs from the dense coefficients for " << fen << endl;
+            }
+        }
+    }
+
+    cout << "Checked " << position_count << " random positions, " << mismatch_count << " mismatches" << endl;
+    return mismatch_count == 0;
+}
+
+// Phase after the move, updated from the captured and promoted pieces instead of recounting the board
+static int32_t get_child_phase(const chess::Board& board, const chess::Move move, int32_t phase)
+{
+    const auto type = move.typeOf();
+    if (type == chess::Move::NORMAL || type == chess::Move::PROMOTION)
+    {
+        phase -= get_phase_value(board.at(move.to()).type());
+    }
+    if (type == chess::Move::PROMOTION)
+    {
+        phase += get_phase_value(move.promotionType());
+    }
+    return phase;
+}
+
+// The static evaluation reads the trace directly, with the phase kept up to date by the caller,
+// so a node costs one full trace extraction and no allocations once the thread's buffers have grown.
+// Only the phase is incremental, the piece-square and material terms are extracted again with the rest.
+static tune_t quiescence(chess::Board& board, const parameters_t& parameters, QsearchScratch& scratch, SparseTrace& trace, const int32_t phase, tune_t alpha, tune_t beta, const int32_t ply)
+{
+    auto& pv_table = scratch.pv_table;
+    pv_table[ply].length = 0;
+    scratch.nodes++;
+
+    get_trace(board, trace, static_cast<int32_t>(parameters.size()));
+
+    EntryMetadata eval_entry{};
 #if TAPERED
-    entry.phase = get_phase(board);
+    eval_entry.endgame_scale = trace.endgame_scale;
+    eval_entry.phase = static_cast<uint8_t>(phase);
 #endif
-    entry.additional_score = 0;
-    tune_t eval = linear_eval(entry, parameters);
-    if(!entry.white_to_move)
+    tune_t eval = linear_eval(trace.coefficients, eval_entry, parameters);
+    if(board.sideToMove() == chess::Color::BLACK)
     {
         eval = -eval;
     }
@@ -430,9 +641,10 @@ static tune_t quiescence(chess::Board& board, const parameters_t& parameters, pv
         moves[best_move_index] = moves[move_index];
         move_scores[best_move_index] = move_scores[move_index];
 
+        const auto child_phase = get_child_phase(board, move, phase);
         board.makeMove(move);
 
-        const auto child_score = -quiescence(board, parameters, pv_table, -beta, -alpha, ply + 1);
+        const auto child_score = -quiescence(board, parameters, scratch, trace, child_phase, -beta, -alpha, ply + 1);
         if(child_score > best_score)
         {
             best_score = child_score;
@@ -463,27 +675,10 @@ static tune_t quiescence(chess::Board& board, const parameters_t& parameters, pv
     return best_score;
 }
 
-string cleanup_fen(const string& initial_fen)
-{
-    int space_count = 0;
-    size_t pos = 0;
-    for (size_t i = 0; i < initial_fen.size(); ++i) {
-        if (initial_fen[i] == ' ') {
-            ++space_count;
-        }
-        if (space_count == 4) {
-            pos = i;
-            break;
-        }
-    }
-    const auto clean_fen = initial_fen.substr(0, pos);
-    return clean_fen;
-}
-
-chess::Board quiescence_root(const parameters_t& parameters, chess::Board board)
+chess::Board quiescence_root(const parameters_t& parameters, chess::Board board, QsearchScratch& scratch, SparseTrace& trace)
 {
-    pv_table_t pv_table {};
-    auto score = quiescence(board, parameters, pv_table, -inf, inf, 0);
+    const auto& pv_table = scratch.pv_table;
+    auto score = quiescence(board, parameters, scratch, trace, get_phase(board), -inf, inf, 0);
     if(board.sideToMove() == chess::Color::BLACK)
     {
         score = -score;
@@ -509,16 +704,16 @@ chess::Board quiescence_root(const parameters_t& parameters, chess::Board board)
     return board;
 }
 
-static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameters, vector<Entry>& entries, const string& original_fen)
+// trace, entry and qsearch are scratch buffers of the calling thread, kept between positions so they stop allocating
+static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameters, SegmentBuilder& entries, const string_view line, SparseTrace& trace, Entry& entry, QsearchScratch& qsearch)
 {
     if constexpr (print_data_entries)
     {
         //cout << fen;
     }
 
-    //string fen;
-    const auto clean_fen = cleanup_fen(original_fen);
-    chess::Board board = chess::Board(clean_fen);
+    const auto parsed_line = parse_line(line, side_to_move_wdl);
+    chess::Board board = chess::Board(parsed_line.fen);
 
     if constexpr (filter_in_check)
     {
@@ -528,30 +723,19 @@ static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameter
 
     if constexpr (enable_qsearch)
     {
-        board = quiescence_root(parameters, board);
+        board = quiescence_root(parameters, board, qsearch, trace);
     }
 
-    EvalResult eval_result;
-    if constexpr (TuneEval::supports_external_chess_eval)
-    {
-        eval_result = TuneEval::get_external_eval_result(board);
-    }
-    else
-    {
-        auto fen = board.getFen();
-        eval_result = TuneEval::get_fen_eval_result(fen);
-    }
+    get_trace(board, trace, static_cast<int32_t>(parameters.size()));
 
-    Entry entry;
     //entry.white_to_move = get_fen_color_to_move(fen);
     entry.white_to_move = board.sideToMove() == chess::Color::WHITE;
 #if TAPERED
-    entry.endgame_scale = eval_result.endgame_scale;
+    entry.endgame_scale = trace.endgame_scale;
 #endif
-    const bool original_white_to_move = get_fen_color_to_move(original_fen);
     //cout << (entry.white_to_move ? "w" : "b") << " ";
-    entry.wdl = get_fen_wdl(original_fen, original_white_to_move, entry.white_to_move, side_to_move_wdl);
-    get_coefficient_entries(eval_result.coefficients, entry.coefficients, static_cast<int32_t>(parameters.size()));
+    entry.wdl = parsed_line.wdl;
+    entry.coefficients.assign(trace.coefficients.begin(), trace.coefficients.end());
 #if TAPERED
     entry.phase = get_phase(board);
 #endif
@@ -563,258 +747,1927 @@ static void parse_fen(const bool side_to_move_wdl, const parameters_t& parameter
         {
             cout << " Eval: " << score << endl;
         }
-        entry.additional_score = eval_result.score - score;
+        entry.additional_score = trace.score - score;
     }
 
-    entries.push_back(entry);
+    entries.append(entry);
 }
 
-static void read_fens(const DataSource& source, const high_resolution_clock::time_point start, vector<string>& fens)
+// Size of the byte blocks the data sources are read in
+static constexpr size_t data_load_block_size = 4 * 1024 * 1024;
+
+// Whole lines of a data source, the last one possibly without a newline
+struct DataBlock
 {
-    cout << "Reading " << source.path;
-    if (source.position_limit > 0)
+    size_t source_index;
+    uint64_t sequence;
+    string data;
+};
+
+// Hands blocks from the reader threads to the parsers. Bounded so the readers stay at most a few blocks ahead.
+class BlockQueue
+{
+public:
+    BlockQueue(const size_t capacity, const size_t producer_count) : capacity(capacity), producer_count(producer_count)
     {
-        cout << " (" << source.position_limit << " positions)";
     }
-    cout << "..." << endl;
 
-    ifstream file(source.path);
-    if (!file)
+    void push(DataBlock&& block)
     {
-        cout << "Failed to open " << source.path << endl;
-        throw runtime_error("Failed to open data source");
+        unique_lock lock(mut);
+        not_full.wait(lock, [this]
+        {
+            return blocks.size() < capacity;
+        });
+        blocks.push(std::move(block));
+        not_empty.notify_one();
     }
 
-    while (!file.eof())
+    // Returns false once all producers are done and the queue is empty
+    bool pop(DataBlock& block)
     {
-        if (source.position_limit > 0 && fens.size() >= source.position_limit)
+        unique_lock lock(mut);
+        not_empty.wait(lock, [this]
         {
-            break;
+            return !blocks.empty() || producer_count == 0;
+        });
+        if (blocks.empty())
+        {
+            return false;
+        }
+
+        block = std::move(blocks.front());
+        blocks.pop();
+        not_full.notify_one();
+        return true;
+    }
+
+    void producer_done()
+    {
+        lock_guard lock(mut);
+        producer_count--;
+        not_empty.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    size_t producer_count;
+    mutex mut;
+    condition_variable not_full;
+    condition_variable not_empty;
+    queue<DataBlock> blocks;
+};
+
+// Reads a source in blocks split on line boundaries. Stops at the first empty line or after position_limit lines.
+static void read_blocks(const DataSource& source, const size_t source_index, ifstream& file, BlockQueue& queue, const high_resolution_clock::time_point start)
+{
+    string carry;
+    uint64_t sequence = 0;
+    int64_t line_count = 0;
+    bool done = false;
+    while (!done)
+    {
+        string block = std::move(carry);
+        carry = string();
+        const auto carry_size = block.size();
+        block.resize(carry_size + data_load_block_size);
+        file.read(block.data() + carry_size, data_load_block_size);
+        const auto at_end = !file;
+        block.resize(carry_size + static_cast<size_t>(file.gcount()));
+
+        if (!at_end)
+        {
+            const auto last_newline = block.rfind('\n');
+            if (last_newline == string::npos)
+            {
+                // A single line longer than a block, keep reading
+                carry = std::move(block);
+                continue;
+            }
+            carry.assign(block, last_newline + 1);
+            block.resize(last_newline + 1);
         }
 
-        string original_fen;
-        getline(file, original_fen);
-        if (original_fen.empty())
+        size_t position = 0;
+        while (position < block.size())
         {
-            break;
+            if (source.position_limit > 0 && line_count >= source.position_limit)
+            {
+                break;
+            }
+
+            const auto newline = static_cast<const char*>(memchr(block.data() + position, '\n', block.size() - position));
+            const auto line_end = newline != nullptr ? static_cast<size_t>(newline - block.data()) : block.size();
+            if (line_end == position)
+            {
+                break;
+            }
+
+            line_count++;
+            position = line_end + 1;
+        }
+
+        if (position < block.size() || at_end || (source.position_limit > 0 && line_count >= source.position_limit))
+        {
+            block.resize(min(position, block.size()));
+            done = true;
         }
 
-        fens.push_back(original_fen);
+        if (!block.empty())
+        {
+            queue.push({ source_index, sequence++, std::move(block) });
+        }
     }
 
     print_elapsed(start);
-    std::cout << "Read " << fens.size() << " positions from " << source.path << endl;
+    cout << "Read " << line_count << " positions from " << source.path << endl;
 }
 
-static void parse_fens(ThreadPool& thread_pool, const DataSource& source, const vector<string>& fens, const parameters_t& parameters, const high_resolution_clock::time_point time_start, vector<Entry>& entries)
+// Parses the sources concurrently. Reader threads split the files into blocks and the pool's workers parse the lines
+// straight out of the blocks. The entries of each source are returned in file order.
+static vector<SegmentBuilder> parse_sources(ThreadPool& thread_pool, const vector<const DataSource*>& sources, const parameters_t& parameters, const high_resolution_clock::time_point start)
 {
-    cout << "Parsing " << fens.size() << " positions..." << endl;
-    array<vector<Entry>, data_load_thread_count> thread_entries;
-    const auto side_to_move_wdl = source.side_to_move_wdl;
-    constexpr int batch_size = 10000;
-    mutex mut;
-    queue<vector<string>> batches;
-    vector<string> current_batch;
-    for(const auto& fen : fens)
+    if (sources.empty())
     {
-        current_batch.push_back(fen);
-        if (current_batch.size() == batch_size)
+        return {};
+    }
+
+    vector<ifstream> files;
+    for (const auto* source : sources)
+    {
+        cout << "Reading " << source->path;
+        if (source->position_limit > 0)
+        {
+            cout << " (" << source->position_limit << " positions)";
+        }
+        cout << "..." << endl;
+
+        auto& file = files.emplace_back(source->path, ios::binary);
+        if (!file)
         {
-            batches.emplace(current_batch);
-            current_batch.clear();
+            cout << "Failed to open " << source->path << endl;
+            throw runtime_error("Failed to open data source");
         }
     }
-    if(!current_batch.empty())
+
+    const auto parse_start = high_resolution_clock::now();
+    const auto reader_count = min(sources.size(), static_cast<size_t>(data_load_thread_count));
+    BlockQueue queue(2 * static_cast<size_t>(data_load_thread_count), reader_count);
+    atomic<size_t> next_source = 0;
+    vector<thread> readers;
+    for (size_t reader_index = 0; reader_index < reader_count; reader_index++)
     {
-        batches.emplace(current_batch);
+        readers.emplace_back([&]()
+        {
+            for (auto source_index = next_source++; source_index < sources.size(); source_index = next_source++)
+            {
+                read_blocks(*sources[source_index], source_index, files[source_index], queue, start);
+            }
+            queue.producer_done();
+        });
     }
 
+    vector<vector<unique_ptr<SegmentBuilder>>> block_entries(sources.size());
+    mutex block_entries_mutex;
+    atomic<int64_t> position_count = 0;
+    atomic<int64_t> qsearch_nodes = 0;
     for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
     {
-        thread_pool.enqueue([thread_id, &thread_entries, &mut, side_to_move_wdl, parameters, &batches, time_start]()
+        thread_pool.enqueue([&]()
         {
-            vector<Entry> entries;
-
-            int position_count = 0;
-            while(true)
+            DataBlock block;
+            SparseTrace trace;
+            Entry entry;
+            QsearchScratch qsearch;
+            while (queue.pop(block))
             {
-                vector<string> thread_batch;
+                const auto side_to_move_wdl = sources[block.source_index]->side_to_move_wdl;
+                auto entries = make_unique<SegmentBuilder>();
+                const char* position = block.data.data();
+                const char* const block_end = position + block.data.size();
+                while (position < block_end)
                 {
-                    lock_guard lock(mut);
-                    if(batches.empty())
+                    auto line_end = static_cast<const char*>(memchr(position, '\n', block_end - position));
+                    if (line_end == nullptr)
                     {
-                        break;
+                        line_end = block_end;
                     }
-                    thread_batch = batches.front();
-                    batches.pop();
+                    parse_fen(side_to_move_wdl, parameters, *entries, string_view(position, line_end - position), trace, entry, qsearch);
+                    position = line_end + 1;
                 }
 
-                constexpr auto thread_data_load_print_interval = data_load_print_interval / data_load_thread_count;
-                for(auto& fen : thread_batch)
+                const auto block_nodes = qsearch.nodes;
+                qsearch.nodes = 0;
+                const auto nodes = qsearch_nodes.fetch_add(block_nodes) + block_nodes;
+                const auto block_size = static_cast<int64_t>(entries->size());
+                const auto previous_count = position_count.fetch_add(block_size);
+                if ((previous_count + block_size) / data_load_print_interval != previous_count / data_load_print_interval)
                 {
-                    parse_fen(side_to_move_wdl, parameters, entries, fen);
-                    position_count++;
-                    if (thread_id == 0 && position_count % thread_data_load_print_interval == 0)
+                    print_elapsed(start);
+                    cout << "Parsed ~" << previous_count + block_size << " positions...";
+                    if constexpr (enable_qsearch)
                     {
-                        print_elapsed(time_start);
-                        std::cout << "Parsed ~" << position_count * data_load_thread_count << " positions..." << endl;
+                        const auto seconds = duration<double>(high_resolution_clock::now() - parse_start).count();
+                        cout << " (" << static_cast<int64_t>(nodes / max(seconds, 1e-9)) << " qsearch nodes/s)";
                     }
+                    cout << endl;
                 }
-            }
 
-            thread_entries[thread_id] = entries;
+                lock_guard lock(block_entries_mutex);
+                auto& source_blocks = block_entries[block.source_index];
+                if (source_blocks.size() <= block.sequence)
+                {
+                    source_blocks.resize(block.sequence + 1);
+                }
+                source_blocks[block.sequence] = std::move(entries);
+            }
         });
     }
 
     thread_pool.wait_for_completion();
+    for (auto& reader : readers)
+    {
+        reader.join();
+    }
 
-    for (int thread_id = 0; thread_id < data_load_thread_count; thread_id++)
+    const auto parse_seconds = duration<double>(high_resolution_clock::now() - parse_start).count();
+    print_elapsed(start);
+    cout << "Parsed " << position_count << " positions in " << parse_seconds << "s (" << static_cast<int64_t>(position_count / max(parse_seconds, 1e-9)) << " lines/s)" << endl;
+    if constexpr (enable_qsearch)
+    {
+        cout << "Searched " << qsearch_nodes << " qsearch nodes (" << static_cast<int64_t>(qsearch_nodes / max(parse_seconds, 1e-9)) << " nodes/s, " << qsearch_nodes / max<int64_t>(position_count, 1) << " per position)" << endl;
+    }
+
+    vector<SegmentBuilder> source_entries(sources.size());
+    for (size_t source_index = 0; source_index < sources.size(); source_index++)
     {
-        for(const Entry& entry : thread_entries[thread_id])
+        for (auto& entries : block_entries[source_index])
         {
-            entries.push_back(entry);
+            source_entries[source_index].append(*entries);
+            entries.reset();
         }
     }
+    return source_entries;
 }
 
-static void load_fens(ThreadPool& thread_pool, const DataSource& source, const parameters_t& parameters, const high_resolution_clock::time_point start, vector<Entry>& entries)
+static void store_parsed_source(const DataSource& source, const CacheKey& cache_key, SegmentBuilder&& source_entries, const high_resolution_clock::time_point start, EntryStore& entries)
 {
-    vector<string> fens;
-    read_fens(source, start, fens);
-    parse_fens(thread_pool, source, fens, parameters, start, entries);
-}
+    if constexpr (enable_dataset_cache)
+    {
+        const auto cache_path = get_cache_path(source);
+        save_cache(cache_path, cache_key, source_entries);
+        print_elapsed(start);
+        cout << "Wrote cache " << cache_path << endl;
 
-static tune_t sigmoid(const tune_t K, const tune_t eval)
-{
-    return static_cast<tune_t>(1) / (static_cast<tune_t>(1) + exp(-K * eval / static_cast<tune_t>(400)));
+        // Tune from the mapped cache so the parsed copy can be released
+        if (entries.add_cache(cache_path, cache_key))
+        {
+            return;
+        }
+    }
+
+    entries.add_segment(std::move(source_entries));
 }
 
-static tune_t get_average_error(ThreadPool& thread_pool, const vector<Entry>& entries, const parameters_t& parameters, tune_t K)
+static void load_sources(ThreadPool& thread_pool, const vector<DataSource>& sources, const parameters_t& parameters, const high_resolution_clock::time_point start, EntryStore& entries)
 {
-    array<tune_t, thread_count> thread_errors;
-    for(int thread_id = 0; thread_id < thread_count; thread_id++)
+    vector<CacheKey> cache_keys(sources.size());
+    vector<uint8_t> cached(sources.size(), 0);
+    vector<const DataSource*> pending_sources;
+    for (size_t source_index = 0; source_index < sources.size(); source_index++)
     {
-        thread_pool.enqueue([thread_id, &thread_errors, &entries, &parameters, K]()
+        if constexpr (enable_dataset_cache)
         {
-            const auto entries_per_thread = entries.size() / thread_count;
-            const auto start = static_cast<int>(thread_id * entries_per_thread);
-            const auto end = static_cast<int>((thread_id + 1) * entries_per_thread - 1);
-            tune_t error = 0;
-            for (int i = start; i < end; i++)
-            {
-                const auto& entry = entries[i];
-                const auto eval = linear_eval(entry, parameters);
-                const auto sig = sigmoid(K, eval);
-                const auto diff = entry.wdl - sig;
-                const auto entry_error = pow(diff, 2);
-                error += entry_error;
-            }
-            thread_errors[thread_id] = error;
-        });
+            cache_keys[source_index] = get_cache_key(sources[source_index], parameters);
+            cached[source_index] = is_cache_current(get_cache_path(sources[source_index]), cache_keys[source_index]);
+        }
+        if (!cached[source_index])
+        {
+            pending_sources.push_back(&sources[source_index]);
+        }
     }
 
-    thread_pool.wait_for_completion();
+    auto parsed_entries = parse_sources(thread_pool, pending_sources, parameters, start);
 
-    tune_t total_error = 0;
-    for (int thread_id = 0; thread_id < thread_count; thread_id++)
+    // Entries are added in the order of the sources
+    size_t parsed_index = 0;
+    for (size_t source_index = 0; source_index < sources.size(); source_index++)
     {
-        total_error += thread_errors[thread_id];
-    }
-
-    const tune_t avg_error = total_error / static_cast<tune_t>(entries.size());
-    return avg_error;
-}
+        const auto& source = sources[source_index];
+        if (!cached[source_index])
+        {
+            store_parsed_source(source, cache_keys[source_index], std::move(parsed_entries[parsed_index]), start, entries);
+            parsed_entries[parsed_index] = SegmentBuilder();
+            parsed_index++;
+            continue;
+        }
+
+        const auto first_entry = entries.size();
+        const auto cache_path = get_cache_path(source);
+        if (entries.add_cache(cache_path, cache_keys[source_index]))
+        {
+            print_elapsed(start);
+            cout << "Loaded " << entries.size() - first_entry << " cached positions from " << cache_path << endl;
+            continue;
+        }
+
+        auto source_entries = parse_sources(thread_pool, { &source }, parameters, start);
+        store_parsed_source(source, cache_keys[source_index], std::move(source_entries.front()), start, entries);
+    }
+}
+
+static tune_t sigmoid(const tune_t K, const tune_t eval)
+{
+    return static_cast<tune_t>(1) / (static_cast<tune_t>(1) + exp(-K * eval / static_cast<tune_t>(400)));
+}
+
+static Kernels::KernelType selected_kernel = Kernels::KernelType::Scalar;
+
+// Number of entries whose gradients are summed before being added to the compensated per-thread total
+static constexpr uint64_t gradient_block_size = 4096;
+
+struct CompensatedSum
+{
+    tune_t sum = 0;
+    tune_t compensation = 0;
+};
+
+// Compensated summation, keeps the reductions over many entries accurate when tune_t is float
+static void kahan_add(tune_t& sum, tune_t& compensation, const tune_t value)
+{
+    const tune_t corrected = value - compensation;
+    const tune_t new_sum = sum + corrected;
+    compensation = (new_sum - sum) - corrected;
+    sum = new_sum;
+}
+
+static void kahan_add(CompensatedSum& total, const tune_t value)
+{
+    kahan_add(total.sum, total.compensation, value);
+}
+
+// Adds values to sum with compensation and clears values
+template<typename G>
+static void kahan_add(G& sum, G& compensation, G& values)
+{
+    for (size_t parameter_index = 0; parameter_index < sum.size(); parameter_index++)
+    {
+#if TAPERED
+        for (int phase_stage = 0; phase_stage < 2; phase_stage++)
+        {
+            kahan_add(sum[parameter_index][phase_stage], compensation[parameter_index][phase_stage], values[parameter_index][phase_stage]);
+            values[parameter_index][phase_stage] = 0;
+        }
+#else
+        kahan_add(sum[parameter_index], compensation[parameter_index], values[parameter_index]);
+        values[parameter_index] = 0;
+#endif
+    }
+}
+
+static tune_t get_segment_error(const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& parameters, const tune_t K)
+{
+    if constexpr (Kernels::simd_supported)
+    {
+        if (selected_kernel != Kernels::KernelType::Scalar)
+        {
+            return Kernels::sweep(selected_kernel, segment, begin, end, reinterpret_cast<const tune_t*>(parameters.data()), K, nullptr);
+        }
+    }
+
+    tune_t error = 0;
+    tune_t compensation = 0;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        const auto& entry = segment.metadata[i];
+        const auto eval = linear_eval(segment.get_coefficients(i), entry, parameters);
+        const auto sig = sigmoid(K, eval);
+        const auto diff = entry.wdl - sig;
+        const auto entry_error = entry.weight * pow(diff, 2);
+        kahan_add(error, compensation, entry_error);
+    }
+    return error;
+}
+
+// Average error over all positions, from the weighted error sum of the entries
+static tune_t to_average_error(const EntryStore& entries, const tune_t error_sum)
+{
+    return static_cast<tune_t>((error_sum + entries.duplicate_error()) / static_cast<double>(entries.total_weight()));
+}
+
+static tune_t get_average_error(ThreadPool& thread_pool, const EntryStore& entries, const parameters_t& parameters, tune_t K)
+{
+    const auto total_error = thread_pool.parallel_reduce(0, entries.size(), parallel_grain_size, CompensatedSum{},
+        [&entries, &parameters, K](const uint64_t begin, const uint64_t end, CompensatedSum& error)
+        {
+            entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+            {
+                kahan_add(error, get_segment_error(segment, segment_start, segment_end, parameters, K));
+            });
+        },
+        [](CompensatedSum& total, const CompensatedSum& partial)
+        {
+            kahan_add(total, partial.sum);
+        });
+
+    return to_average_error(entries, total_error.sum);
+}
+
+// Sums over the entries of the error and its first and second derivatives with respect to K.
+// gauss_newton is the second derivative without the residual term, which is never negative.
+struct KDerivatives
+{
+    CompensatedSum error;
+    CompensatedSum first;
+    CompensatedSum second;
+    CompensatedSum gauss_newton;
+};
+
+static void add_segment_k_derivatives(KDerivatives& derivatives, const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& parameters, const tune_t K)
+{
+    for (uint64_t i = begin; i < end; i++)
+    {
+        const auto& entry = segment.metadata[i];
+        const auto scaled_eval = linear_eval(segment.get_coefficients(i), entry, parameters) / static_cast<tune_t>(400);
+        const auto sig = sigmoid(K, scaled_eval * 400);
+        const auto diff = entry.wdl - sig;
+
+        // d sig / dK = sig (1 - sig) eval / 400, d2 sig / dK2 = d sig / dK (1 - 2 sig) eval / 400
+        const auto sig_first = sig * (1 - sig) * scaled_eval;
+        const auto sig_second = sig_first * (1 - 2 * sig) * scaled_eval;
+        const tune_t weight = entry.weight;
+        kahan_add(derivatives.error, weight * diff * diff);
+        kahan_add(derivatives.first, -2 * weight * diff * sig_first);
+        kahan_add(derivatives.second, 2 * weight * (sig_first * sig_first - diff * sig_second));
+        kahan_add(derivatives.gauss_newton, 2 * weight * sig_first * sig_first);
+    }
+}
+
+// Returns the average error at K and its first and second derivatives with respect to K, from a single pass
+static KDerivatives get_k_derivatives(ThreadPool& thread_pool, const EntryStore& entries, const parameters_t& parameters, const tune_t K)
+{
+    auto derivatives = thread_pool.parallel_reduce(0, entries.size(), parallel_grain_size, KDerivatives{},
+        [&entries, &parameters, K](const uint64_t begin, const uint64_t end, KDerivatives& partial)
+        {
+            entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+            {
+                add_segment_k_derivatives(partial, segment, segment_start, segment_end, parameters, K);
+            });
+        },
+        [](KDerivatives& total, const KDerivatives& partial)
+        {
+            kahan_add(total.error, partial.error.sum);
+            kahan_add(total.first, partial.first.sum);
+            kahan_add(total.second, partial.second.sum);
+            kahan_add(total.gauss_newton, partial.gauss_newton.sum);
+        });
+
+    const auto position_count = static_cast<tune_t>(entries.total_weight());
+    derivatives.error.sum = to_average_error(entries, derivatives.error.sum);
+    derivatives.first.sum /= position_count;
+    derivatives.second.sum /= position_count;
+    derivatives.gauss_newton.sum /= position_count;
+    return derivatives;
+}
+
+// Newton's method on the error as a function of K. Where the error is not convex in K, the Gauss-Newton part of the
+// second derivative, which is always positive, is used instead, and a step is halved until it lowers the error.
+static tune_t find_optimal_k(ThreadPool& thread_pool, const EntryStore& entries, const parameters_t& parameters)
+{
+    constexpr tune_t deviation_goal = 1e-6;
+    constexpr tune_t min_step = 1e-9;
+    constexpr int32_t max_iterations = 100;
+    tune_t K = 2.5;
+
+    auto derivatives = get_k_derivatives(thread_pool, entries, parameters, K);
+    for (int32_t iteration = 0; iteration < max_iterations && fabs(derivatives.first.sum) > deviation_goal; iteration++)
+    {
+        cout << "Current K: " << K << ", error: " << derivatives.error.sum << ", deviation: " << derivatives.first.sum << ", curvature: " << derivatives.second.sum << endl;
+
+        const auto curvature = derivatives.second.sum > 0 ? derivatives.second.sum : derivatives.gauss_newton.sum;
+        if (curvature <= 0)
+        {
+            throw runtime_error("The error does not depend on K, all evaluations are zero");
+        }
+
+        auto step = -derivatives.first.sum / curvature;
+        auto next = get_k_derivatives(thread_pool, entries, parameters, K + step);
+        while (next.error.sum > derivatives.error.sum && fabs(step) > min_step)
+        {
+            step /= 2;
+            next = get_k_derivatives(thread_pool, entries, parameters, K + step);
+        }
+
+        K += step;
+        derivatives = next;
+        if (fabs(step) <= min_step)
+        {
+            break;
+        }
+    }
+
+    return K;
+}
+
+// Adds the weighted gradient of a single entry and returns its weighted squared error
+template<typename G, typename C>
+static tune_t update_single_gradient(G& gradient, const C& coefficients, const EntryMetadata& entry, const parameters_t& params, tune_t K) {
+
+    const tune_t eval = linear_eval(coefficients, entry, params);
+    const tune_t sig = sigmoid(K, eval);
+    const tune_t diff = entry.wdl - sig;
+    const tune_t weighted_diff = entry.weight * diff;
+    const tune_t res = weighted_diff * sig * (1 - sig);
+
+#if TAPERED
+    const auto mg_base = res * (entry.phase / static_cast<tune_t>(24));
+    const auto eg_base = res - mg_base;
+#endif
+
+    for (const auto& coefficient : coefficients)
+    {
+#if TAPERED
+        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Midgame)] += mg_base * coefficient.value;
+        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Endgame)] += eg_base * coefficient.value * entry.endgame_scale;
+#else
+        gradient[coefficient.index] += res * coefficient.value;
+#endif
+    }
+
+    return weighted_diff * diff;
+}
+
+// Adds the gradient of entries [begin, end) of the segment and returns their summed squared error
+template<typename G>
+static tune_t add_segment_gradient(G& gradient, const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& params, const tune_t K)
+{
+    if constexpr (Kernels::simd_supported)
+    {
+        if (selected_kernel != Kernels::KernelType::Scalar)
+        {
+            return Kernels::sweep(selected_kernel, segment, begin, end, reinterpret_cast<const tune_t*>(params.data()), K, reinterpret_cast<tune_t*>(gradient.data()));
+        }
+    }
+
+    tune_t error = 0;
+    tune_t compensation = 0;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        kahan_add(error, compensation, update_single_gradient(gradient, segment.get_coefficients(i), segment.metadata[i], params, K));
+    }
+    return error;
+}
+
+// Allocates on cache line boundaries, so the accumulators of different workers never share a line
+template<typename T>
+struct CacheAlignedAllocator
+{
+    using value_type = T;
+    static constexpr std::align_val_t alignment{ 64 };
+
+    CacheAlignedAllocator() = default;
+
+    template<typename U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U>&)
+    {
+    }
+
+    T* allocate(const size_t count)
+    {
+        return static_cast<T*>(::operator new(count * sizeof(T), alignment));
+    }
+
+    void deallocate(T* pointer, const size_t)
+    {
+        ::operator delete(pointer, alignment);
+    }
+
+    template<typename U>
+    bool operator==(const CacheAlignedAllocator<U>&) const
+    {
+        return true;
+    }
+};
+
+using accumulator_t = vector<parameters_t::value_type, CacheAlignedAllocator<parameters_t::value_type>>;
+
+// Per-worker state of the gradient pass. Created by the worker on its first epoch, then reused and cleared in place.
+struct alignas(64) GradientAccumulator
+{
+    accumulator_t gradient;
+    accumulator_t compensation;
+    accumulator_t block_gradient;
+    CompensatedSum error;
+};
+
+using accumulators_t = vector<unique_ptr<GradientAccumulator>>;
+
+// Number of tuned values, the midgame and endgame values of a tapered parameter count separately
+static size_t get_value_count(const parameters_t& parameters)
+{
+#if TAPERED
+    return parameters.size() * 2;
+#else
+    return parameters.size();
+#endif
+}
+
+static GradientAccumulator& get_accumulator(accumulators_t& accumulators, const uint32_t worker_index, const size_t parameter_count)
+{
+    auto& accumulator = accumulators[worker_index];
+    if (!accumulator)
+    {
+        accumulator = make_unique<GradientAccumulator>();
+        accumulator->gradient.resize(parameter_count);
+        accumulator->compensation.resize(parameter_count);
+        accumulator->block_gradient.resize(parameter_count);
+    }
+    return *accumulator;
+}
+
+// Adds the gradient of entries [begin, end) to the block gradient of the accumulator
+static void accumulate_range(GradientAccumulator& accumulator, const EntryStore& entries, const uint64_t begin, const uint64_t end, const parameters_t& params, const tune_t K)
+{
+    entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+    {
+        kahan_add(accumulator.error, add_segment_gradient(accumulator.block_gradient, segment, segment_start, segment_end, params, K));
+    });
+}
+
+// Returns the summed error of all accumulators and clears it
+static tune_t take_accumulated_error(accumulators_t& accumulators)
+{
+    CompensatedSum total_error;
+    for (auto& accumulator : accumulators)
+    {
+        if (accumulator)
+        {
+            kahan_add(total_error, accumulator->error.sum);
+            accumulator->error = CompensatedSum{};
+        }
+    }
+    return total_error.sum;
+}
+
+// Parameters whose gradient is summed in a pass, the accumulators it is summed into and the resulting error
+struct GradientTarget
+{
+    accumulators_t* accumulators;
+    const parameters_t* params;
+    tune_t K;
+    tune_t error = 0;
+};
+
+// Adds the gradient of each target's parameters to its accumulators and, from the same evaluations, sets its average error.
+// All targets are swept over one block of entries before moving to the next, so the entries are read from memory once.
+static void accumulate_gradients(ThreadPool& thread_pool, const span<GradientTarget> targets, const EntryStore& entries)
+{
+    thread_pool.parallel_for(0, entries.size(), parallel_grain_size, [&](const uint64_t begin, const uint64_t end, const uint32_t worker_index)
+    {
+        // Entries are summed plainly within a block, the blocks are then summed with compensation
+        for (auto block_start = begin; block_start < end; block_start += gradient_block_size)
+        {
+            const auto block_end = min(block_start + gradient_block_size, end);
+            for (const auto& target : targets)
+            {
+                auto& accumulator = get_accumulator(*target.accumulators, worker_index, target.params->size());
+                accumulate_range(accumulator, entries, block_start, block_end, *target.params, target.K);
+                kahan_add(accumulator.gradient, accumulator.compensation, accumulator.block_gradient);
+            }
+        }
+    });
+
+    for (auto& target : targets)
+    {
+        target.error = to_average_error(entries, take_accumulated_error(*target.accumulators));
+    }
+}
+
+// Adds the gradient of params to the accumulator of each worker and, from the same evaluations, returns the average error of params
+static tune_t accumulate_gradient(ThreadPool& thread_pool, accumulators_t& accumulators, const EntryStore& entries, const parameters_t& params, tune_t K)
+{
+    GradientTarget target{ &accumulators, &params, K };
+    accumulate_gradients(thread_pool, span(&target, 1), entries);
+    return target.error;
+}
+
+// Mini-batches are drawn in chunks of this many consecutive entries, so the vectorized kernels still work on contiguous ranges
+static constexpr uint64_t shuffle_chunk_size = 32;
+
+// Shuffled order of the entries for mini-batch epochs, as chunk indices. The chunks are split into one share per worker,
+// each shuffled in place every epoch, and every batch takes an equal slice of each share.
+// No entries are copied and every batch samples the whole dataset.
+struct BatchSchedule
+{
+    uint64_t entry_count = 0;
+    uint64_t batch_count = 0;
+    vector<vector<uint32_t>> shares;
+    vector<uint32_t> batch_chunks;
+    vector<uint64_t> chunk_weights;
+};
+
+static void init_batch_schedule(ThreadPool& thread_pool, BatchSchedule& schedule, const EntryStore& entries)
+{
+    const auto entry_count = entries.size();
+    const auto chunk_count = (entry_count + shuffle_chunk_size - 1) / shuffle_chunk_size;
+    if (chunk_count > numeric_limits<uint32_t>::max())
+    {
+        throw runtime_error("Too many entries for mini-batch mode");
+    }
+
+    const auto share_count = thread_pool.thread_count();
+    constexpr uint64_t entries_per_batch = max<int64_t>(batch_size, 1);
+    schedule.entry_count = entry_count;
+    schedule.batch_count = max<uint64_t>((entry_count + entries_per_batch - 1) / entries_per_batch, 1);
+    schedule.shares.resize(share_count);
+    schedule.batch_chunks.reserve(chunk_count / schedule.batch_count + share_count);
+    schedule.chunk_weights.resize(chunk_count);
+
+    thread_pool.parallel_for(0, share_count, 1, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        for (auto share_index = begin; share_index < end; share_index++)
+        {
+            const auto share = get_partition(0, chunk_count, share_index, share_count);
+            auto& chunks = schedule.shares[share_index];
+            chunks.resize(share.end - share.begin);
+            for (auto chunk = share.begin; chunk < share.end; chunk++)
+            {
+                chunks[chunk - share.begin] = static_cast<uint32_t>(chunk);
+                uint64_t weight = 0;
+                entries.for_each_range(chunk * shuffle_chunk_size, min((chunk + 1) * shuffle_chunk_size, entry_count), [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+                {
+                    for (auto i = segment_start; i < segment_end; i++)
+                    {
+                        weight += segment.metadata[i].weight;
+                    }
+                });
+                schedule.chunk_weights[chunk] = weight;
+            }
+        }
+    });
+}
+
+// The order of an epoch only depends on shuffle_seed, the share and the epoch: each share is put back in chunk order
+// and shuffled with a generator seeded from those, so a resumed run sees the same batches as an uninterrupted one.
+static void shuffle_batch_schedule(ThreadPool& thread_pool, BatchSchedule& schedule, const int32_t epoch)
+{
+    thread_pool.parallel_for(0, schedule.shares.size(), 1, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        for (auto share_index = begin; share_index < end; share_index++)
+        {
+            auto& chunks = schedule.shares[share_index];
+            iota(chunks.begin(), chunks.end(), static_cast<uint32_t>(get_partition(0, schedule.chunk_weights.size(), share_index, schedule.shares.size()).begin));
+            seed_seq seeds{ static_cast<uint32_t>(shuffle_seed), static_cast<uint32_t>(shuffle_seed >> 32), static_cast<uint32_t>(share_index), static_cast<uint32_t>(epoch) };
+            mt19937_64 generator(seeds);
+            shuffle(chunks.begin(), chunks.end(), generator);
+        }
+    });
+}
+
+// Collects the chunks of a batch into batch_chunks and returns the number of positions in them, the sum of the entry weights
+static uint64_t select_batch(BatchSchedule& schedule, const uint64_t batch_index)
+{
+    schedule.batch_chunks.clear();
+    uint64_t batch_weight = 0;
+    for (const auto& chunks : schedule.shares)
+    {
+        const auto slice = get_partition(0, chunks.size(), batch_index, schedule.batch_count);
+        for (auto position = slice.begin; position < slice.end; position++)
+        {
+            const auto chunk = chunks[position];
+            batch_weight += schedule.chunk_weights[chunk];
+            schedule.batch_chunks.push_back(chunk);
+        }
+    }
+    return batch_weight;
+}
+
+// Adds the gradient of the entries in the selected batch to the accumulators of each target and sets the targets' summed error
+static void accumulate_batch_gradients(ThreadPool& thread_pool, const span<GradientTarget> targets, const EntryStore& entries, const BatchSchedule& schedule)
+{
+    constexpr uint64_t grain_size = parallel_grain_size == 0 ? 0 : max<uint64_t>(parallel_grain_size / shuffle_chunk_size, 1);
+    thread_pool.parallel_for(0, schedule.batch_chunks.size(), grain_size, [&](const uint64_t begin, const uint64_t end, const uint32_t worker_index)
+    {
+        uint64_t block_entry_count = 0;
+        for (auto position = begin; position < end; position++)
+        {
+            const auto chunk_begin = schedule.batch_chunks[position] * shuffle_chunk_size;
+            const auto chunk_end = min(chunk_begin + shuffle_chunk_size, schedule.entry_count);
+            block_entry_count += chunk_end - chunk_begin;
+            const auto flush = block_entry_count >= gradient_block_size || position + 1 == end;
+            for (const auto& target : targets)
+            {
+                auto& accumulator = get_accumulator(*target.accumulators, worker_index, target.params->size());
+                accumulate_range(accumulator, entries, chunk_begin, chunk_end, *target.params, target.K);
+                if (flush)
+                {
+                    kahan_add(accumulator.gradient, accumulator.compensation, accumulator.block_gradient);
+                }
+            }
+            if (flush)
+            {
+                block_entry_count = 0;
+            }
+        }
+    });
+
+    for (auto& target : targets)
+    {
+        target.error = take_accumulated_error(*target.accumulators);
+    }
+}
+
+// Number of values per chunk of the per-value updates
+static constexpr uint64_t value_grain_size = 1024;
+
+// Runs func(begin, end, worker) over the tuned values [0, value_count), split between the workers
+template<typename F>
+static void for_each_value_chunk(ThreadPool& thread_pool, const size_t value_count, F&& func)
+{
+    const auto job_count = static_cast<uint32_t>((value_count + value_grain_size - 1) / value_grain_size);
+
+    // Waking the workers costs more than updating a small parameter set directly
+    if (job_count <= 1)
+    {
+        func(0, value_count, 0);
+        return;
+    }
+    thread_pool.parallel_for(0, value_count, value_grain_size, func, job_count);
+}
+
+// Sums one gradient value over the workers' accumulators in worker order and clears it in them
+static tune_t take_gradient_value(accumulators_t& accumulators, const size_t value_index)
+{
+    CompensatedSum gradient;
+    for (auto& accumulator : accumulators)
+    {
+        if (accumulator)
+        {
+            auto& value = reinterpret_cast<tune_t*>(accumulator->gradient.data())[value_index];
+            kahan_add(gradient, value);
+            value = 0;
+            reinterpret_cast<tune_t*>(accumulator->compensation.data())[value_index] = 0;
+        }
+    }
+    return gradient.sum;
+}
+
+static void adam_update(tune_t& parameter, tune_t& momentum, tune_t& velocity, const tune_t grad, const tune_t learning_rate)
+{
+    constexpr tune_t beta1 = 0.9;
+    constexpr tune_t beta2 = 0.999;
+    momentum = beta1 * momentum + (1 - beta1) * grad;
+    velocity = beta2 * velocity + (1 - beta2) * pow(grad, 2);
+    parameter -= learning_rate * momentum / (static_cast<tune_t>(1e-8) + sqrt(velocity));
+}
+
+// Sums the workers' accumulators in worker order and applies one Adam step, with the parameters split between the workers.
+// The accumulators are cleared for the next epoch on the way. Returns the squared norm of the gradient the step was taken on.
+static double adam_step(ThreadPool& thread_pool, accumulators_t& accumulators, parameters_t& parameters, parameters_t& momentum, parameters_t& velocity, const tune_t K, const tune_t learning_rate, const uint64_t entry_count)
+{
+    const auto scale = -K / static_cast<tune_t>(400) / static_cast<tune_t>(entry_count);
+    auto* values = reinterpret_cast<tune_t*>(parameters.data());
+    auto* momentum_values = reinterpret_cast<tune_t*>(momentum.data());
+    auto* velocity_values = reinterpret_cast<tune_t*>(velocity.data());
+    double squared_norm = 0;
+    mutex norm_mutex;
+    for_each_value_chunk(thread_pool, get_value_count(parameters), [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        double chunk_norm = 0;
+        for (auto value_index = begin; value_index < end; value_index++)
+        {
+            const auto grad = scale * take_gradient_value(accumulators, value_index);
+            chunk_norm += static_cast<double>(grad) * grad;
+            adam_update(values[value_index], momentum_values[value_index], velocity_values[value_index], grad, learning_rate);
+        }
+
+        lock_guard lock(norm_mutex);
+        squared_norm += chunk_norm;
+    });
+    return squared_norm;
+}
+
+// Picks the widest vectorized kernel the CPU supports, after checking it against the scalar loops on a sample of the entries
+static void select_kernel(const EntryStore& entries, const parameters_t& parameters)
+{
+    const auto detected_kernel = Kernels::detect_kernel();
+    if (detected_kernel == Kernels::KernelType::Scalar || entries.size() == 0)
+    {
+        cout << "Using scalar kernels" << endl;
+        return;
+    }
+
+    constexpr uint64_t sample_size = 10000;
+    constexpr tune_t tolerance = 1e-9;
+    constexpr tune_t K = 1;
+    const auto& segment = entries.get_segments().front();
+    const auto sample_end = min(sample_size, segment.size);
+
+#if TAPERED
+    parameters_t scalar_gradient(parameters.size(), pair_t{});
+    parameters_t kernel_gradient(parameters.size(), pair_t{});
+#else
+    parameters_t scalar_gradient(parameters.size(), 0);
+    parameters_t kernel_gradient(parameters.size(), 0);
+#endif
+    const auto scalar_error = get_segment_error(segment, 0, sample_end, parameters, K);
+    const auto scalar_fused_error = add_segment_gradient(scalar_gradient, segment, 0, sample_end, parameters, K);
+
+    selected_kernel = detected_kernel;
+    const auto kernel_error = get_segment_error(segment, 0, sample_end, parameters, K);
+    const auto kernel_fused_error = add_segment_gradient(kernel_gradient, segment, 0, sample_end, parameters, K);
+
+    const auto error_scale = max(fabs(scalar_error), static_cast<tune_t>(1));
+    tune_t max_difference = max(fabs(scalar_error - kernel_error), fabs(scalar_fused_error - kernel_fused_error)) / error_scale;
+    tune_t gradient_norm = 0;
+    for (size_t i = 0; i < parameters.size(); i++)
+    {
+#if TAPERED
+        for (int phase_stage = 0; phase_stage < 2; phase_stage++)
+        {
+            gradient_norm = max(gradient_norm, fabs(scalar_gradient[i][phase_stage]));
+            max_difference = max(max_difference, fabs(scalar_gradient[i][phase_stage] - kernel_gradient[i][phase_stage]));
+        }
+#else
+        gradient_norm = max(gradient_norm, fabs(scalar_gradient[i]));
+        max_difference = max(max_difference, fabs(scalar_gradient[i] - kernel_gradient[i]));
+#endif
+    }
+    max_difference /= max(gradient_norm, static_cast<tune_t>(1));
+
+    if (max_difference > tolerance)
+    {
+        cout << Kernels::get_kernel_name(detected_kernel) << " kernels differ from the scalar loops by " << max_difference << ", using scalar kernels" << endl;
+        selected_kernel = Kernels::KernelType::Scalar;
+        return;
+    }
+
+    cout << "Using " << Kernels::get_kernel_name(selected_kernel) << " kernels (max relative difference to scalar " << max_difference << ")" << endl;
+}
+
+// A tuning run with its own settings and parameters. Several runs can share one loaded dataset.
+struct TuningRun
+{
+    RunConfig config;
+    tune_t K = 0;
+    parameters_t parameters;
+    tune_t initial_error = 0;
+    tune_t error = 0;
+    int32_t epochs = 0;
+};
+
+// Adam state of a run, which only exists during the Adam loop.
+// In full-batch mode the error of an epoch belongs to the parameters it started with, so those are kept until the error is known.
+struct AdamRunState
+{
+    TuningRun* run;
+    parameters_t momentum;
+    parameters_t velocity;
+    accumulators_t accumulators;
+    tune_t learning_rate;
+    parameters_t epoch_start_parameters;
+    parameters_t best_parameters;
+    tune_t best_error;
+    int32_t best_epoch = 0;
+    tune_t window_start_error;
+    double squared_gradient_norm = 0;
+    bool converged = false;
+};
+
+// Copies the Adam state after the epoch into checkpoint, reusing its buffers
+static void fill_checkpoint(Checkpoint& checkpoint, const vector<AdamRunState>& states, const EntryStore& entries, const BatchSchedule& schedule, const int32_t epoch)
+{
+    checkpoint.epoch = epoch;
+    checkpoint.entry_count = entries.size();
+    checkpoint.total_weight = entries.total_weight();
+    checkpoint.batch_size = batch_size;
+    checkpoint.shuffle_seed = shuffle_seed;
+    checkpoint.shuffle_share_count = schedule.shares.size();
+    checkpoint.runs.resize(states.size());
+    for (size_t run_index = 0; run_index < states.size(); run_index++)
+    {
+        const auto& state = states[run_index];
+        auto& saved = checkpoint.runs[run_index];
+        saved.config = state.run->config;
+        saved.K = state.run->K;
+        saved.learning_rate = state.learning_rate;
+        saved.initial_error = state.run->initial_error;
+        saved.error = state.run->error;
+        saved.epochs = state.run->epochs;
+        saved.best_error = state.best_error;
+        saved.best_epoch = state.best_epoch;
+        saved.converged = state.converged;
+        saved.parameters = state.run->parameters;
+        saved.momentum = state.momentum;
+        saved.velocity = state.velocity;
+        saved.best_parameters = state.best_parameters;
+    }
+}
+
+// Checks the stopping criteria of a run after the epoch and returns why it converged, or nullptr to keep going
+static const char* get_convergence_reason(AdamRunState& state, const int32_t epoch)
+{
+    if constexpr (gradient_norm_tolerance > 0)
+    {
+        if (sqrt(state.squared_gradient_norm) < gradient_norm_tolerance)
+        {
+            return "gradient norm below gradient_norm_tolerance";
+        }
+    }
+
+    if constexpr (early_stop_window > 0)
+    {
+        if (epoch % early_stop_window == 0)
+        {
+            const auto improvement = (state.window_start_error - state.best_error) / state.window_start_error;
+            if (improvement < early_stop_tolerance)
+            {
+                return "improvement over early_stop_window below early_stop_tolerance";
+            }
+            state.window_start_error = state.best_error;
+        }
+    }
+    return nullptr;
+}
+
+// Runs Adam over the whole dataset, or over mini-batches with batch_size, for each run's max_epoch epochs or until it converges.
+// All runs still going take their gradient from the same pass over the entries.
+// With resume, the moments and learning rates are restored from the checkpoint and the loop continues after its epoch.
+// Every run ends with the parameters that had the lowest error, which are printed for a single run.
+static void run_adam(ThreadPool& thread_pool, const EntryStore& entries, vector<TuningRun>& runs, const Checkpoint* resume, const high_resolution_clock::time_point start)
+{
+    const auto loop_start = high_resolution_clock::now();
+    vector<AdamRunState> states(runs.size());
+    int32_t max_tune_epoch = 0;
+    for (size_t run_index = 0; run_index < runs.size(); run_index++)
+    {
+        auto& run = runs[run_index];
+        auto& state = states[run_index];
+        state.run = &run;
+        state.accumulators = accumulators_t(thread_pool.thread_count());
+        if (resume)
+        {
+            const auto& saved = resume->runs[run_index];
+            state.momentum = saved.momentum;
+            state.velocity = saved.velocity;
+            state.learning_rate = saved.learning_rate;
+            state.best_parameters = saved.best_parameters;
+            state.best_error = saved.best_error;
+            state.best_epoch = saved.best_epoch;
+            state.converged = saved.converged;
+        }
+        else
+        {
+#if TAPERED
+            parameters_t zero(run.parameters.size(), pair_t{});
+#else
+            parameters_t zero(run.parameters.size(), 0);
+#endif
+            state.momentum = zero;
+            state.velocity = zero;
+            state.learning_rate = static_cast<tune_t>(run.config.initial_learning_rate);
+            state.best_parameters = run.parameters;
+            state.best_error = run.initial_error;
+        }
+        state.window_start_error = state.best_error;
+        max_tune_epoch = max(max_tune_epoch, run.config.max_epoch);
+    }
+    const auto first_epoch = resume ? resume->epoch + 1 : 1;
+
+    // The writer thread is joined when leaving the loop, after the final checkpoint is on disk
+    unique_ptr<CheckpointWriter> checkpoint_writer;
+    Checkpoint checkpoint;
+    if (checkpoint_interval > 0 && first_epoch < max_tune_epoch)
+    {
+        checkpoint_writer = make_unique<CheckpointWriter>(checkpoint_path);
+        cout << "Writing a checkpoint to " << checkpoint_path << " every " << checkpoint_interval << " epochs" << endl;
+    }
+
+    // Time between the first and the last worker finishing the gradient pass, over the epochs since the last report
+    double tail_latency_sum = 0;
+    double tail_latency_max = 0;
+    BatchSchedule batch_schedule;
+    if constexpr (batch_size > 0)
+    {
+        init_batch_schedule(thread_pool, batch_schedule, entries);
+        cout << "Mini-batch mode, " << batch_schedule.batch_count << " batches per epoch" << endl;
+    }
+    vector<AdamRunState*> active_states;
+    vector<GradientTarget> targets;
+    for (int32_t epoch = first_epoch; epoch < max_tune_epoch; epoch++)
+    {
+        active_states.clear();
+        targets.clear();
+        for (auto& state : states)
+        {
+            if (epoch < state.run->config.max_epoch && !state.converged)
+            {
+                if constexpr (batch_size <= 0)
+                {
+                    state.epoch_start_parameters = state.run->parameters;
+                }
+                state.squared_gradient_norm = 0;
+                active_states.push_back(&state);
+                targets.push_back(GradientTarget{ &state.accumulators, &state.run->parameters, state.run->K });
+            }
+        }
+        if (active_states.empty())
+        {
+            break;
+        }
+
+        if constexpr (batch_size > 0)
+        {
+            shuffle_batch_schedule(thread_pool, batch_schedule, epoch);
+            for (uint64_t batch_index = 0; batch_index < batch_schedule.batch_count; batch_index++)
+            {
+                const auto batch_weight = select_batch(batch_schedule, batch_index);
+                accumulate_batch_gradients(thread_pool, targets, entries, batch_schedule);
+                const auto& parallel_stats = thread_pool.get_last_stats();
+                const auto tail_latency = parallel_stats.duration_ms - parallel_stats.first_finish_ms;
+                tail_latency_sum += tail_latency / batch_schedule.batch_count;
+                tail_latency_max = max(tail_latency_max, tail_latency);
+
+                for (size_t run_index = 0; run_index < active_states.size(); run_index++)
+                {
+                    auto& state = *active_states[run_index];
+                    const auto squared_norm = adam_step(thread_pool, state.accumulators, state.run->parameters, state.momentum, state.velocity, state.run->K, state.learning_rate, batch_weight);
+                    state.squared_gradient_norm += squared_norm / batch_schedule.batch_count;
+                }
+            }
+            // The parameters change with every batch, so the errors measured along the way belong to no single parameter set.
+            // Best tracking and early stopping use the error of the parameters the epoch ended with, from a full pass.
+            for (auto* state : active_states)
+            {
+                state->run->error = get_average_error(thread_pool, entries, state->run->parameters, state->run->K);
+            }
+        }
+        else
+        {
+            // Error of the parameters before this epoch's update, computed alongside the gradient
+            accumulate_gradients(thread_pool, targets, entries);
+            const auto& parallel_stats = thread_pool.get_last_stats();
+            const auto tail_latency = parallel_stats.duration_ms - parallel_stats.first_finish_ms;
+            tail_latency_sum += tail_latency;
+            tail_latency_max = max(tail_latency_max, tail_latency);
+
+            for (size_t run_index = 0; run_index < active_states.size(); run_index++)
+            {
+                auto& state = *active_states[run_index];
+                state.run->error = targets[run_index].error;
+                state.squared_gradient_norm = adam_step(thread_pool, state.accumulators, state.run->parameters, state.momentum, state.velocity, state.run->K, state.learning_rate, entries.total_weight());
+            }
+        }
+
+        for (auto* state : active_states)
+        {
+            state->run->epochs = epoch;
+            if (state->run->error < state->best_error)
+            {
+                if constexpr (batch_size > 0)
+                {
+                    state->best_parameters = state->run->parameters;
+                }
+                else
+                {
+                    swap(state->best_parameters, state->epoch_start_parameters);
+                }
+                state->best_error = state->run->error;
+                state->best_epoch = epoch;
+            }
+        }
+
+        if (epoch % 100 == 0)
+        {
+            const auto elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - loop_start).count();
+            const auto epochs_per_second = (epoch - first_epoch + 1) * 1000.0 / elapsed_ms;
+            print_elapsed(start);
+            cout << "Epoch " << epoch << " (" << epochs_per_second << " eps)";
+            if (runs.size() == 1)
+            {
+                cout << ", error " << runs[0].error << ", LR " << states[0].learning_rate << ", gradient norm " << sqrt(states[0].squared_gradient_norm);
+            }
+            cout << ", worker tail " << tail_latency_sum / 100 << "ms avg, " << tail_latency_max << "ms max" << endl;
+            tail_latency_sum = 0;
+            tail_latency_max = 0;
+            if (runs.size() == 1)
+            {
+                TuneEval::print_parameters(runs[0].parameters);
+            }
+            else
+            {
+                for (const auto* state : active_states)
+                {
+                    cout << "    " << state->run->config.name << ": error " << state->run->error << ", LR " << state->learning_rate << ", gradient norm " << sqrt(state->squared_gradient_norm) << endl;
+                }
+            }
+        }
+
+        bool any_running = false;
+        for (auto* state : active_states)
+        {
+            if (epoch % state->run->config.learning_rate_drop_interval == 0)
+            {
+                state->learning_rate *= static_cast<tune_t>(state->run->config.learning_rate_drop_ratio);
+            }
+
+            if (const auto* reason = get_convergence_reason(*state, epoch))
+            {
+                state->converged = true;
+                print_elapsed(start);
+                if (runs.size() > 1)
+                {
+                    cout << state->run->config.name << ": ";
+                }
+                cout << "Converged at epoch " << epoch << ", " << reason << endl;
+            }
+            any_running |= !state->converged && epoch + 1 < state->run->config.max_epoch;
+        }
+
+        // The budget stops the loop without marking the runs as converged, so a resumed run continues.
+        // It counts from the start of the loop, so loading and the K search do not use it up.
+        bool out_of_time = false;
+        if constexpr (time_limit_seconds > 0)
+        {
+            out_of_time = duration<double>(high_resolution_clock::now() - loop_start).count() >= time_limit_seconds;
+            if (out_of_time && any_running)
+            {
+                print_elapsed(start);
+                cout << "Stopping after epoch " << epoch << ", time_limit_seconds reached" << endl;
+            }
+        }
+
+        if constexpr (checkpoint_interval > 0)
+        {
+            if (epoch % checkpoint_interval == 0 || !any_running || out_of_time)
+            {
+                fill_checkpoint(checkpoint, states, entries, batch_schedule, epoch);
+                checkpoint_writer->submit(checkpoint);
+            }
+        }
+
+        if (out_of_time)
+        {
+            break;
+        }
+    }
+
+    for (auto& state : states)
+    {
+        state.run->parameters = state.best_parameters;
+        state.run->error = state.best_error;
+    }
+
+    print_elapsed(start);
+    if (runs.size() == 1)
+    {
+        cout << "Best error " << states[0].best_error << " at epoch " << states[0].best_epoch << endl;
+        TuneEval::print_parameters(states[0].best_parameters);
+    }
+    else
+    {
+        cout << "Best errors:" << endl;
+        for (const auto& state : states)
+        {
+            cout << "    " << state.run->config.name << ": error " << state.best_error << " at epoch " << state.best_epoch << endl;
+        }
+    }
+}
+
+using dense_t = vector<double, CacheAlignedAllocator<double>>;
+
+// Per-worker normal equations of the linearized least squares problem, J^T J and J^T r, where J is the derivative of the
+// sigmoid of every entry with respect to the tuned values and r the residual. Values are indexed as they are laid out in
+// parameters_t. Always accumulated in double, the products of small derivatives lose too much in single precision.
+struct alignas(64) NormalEquations
+{
+    dense_t hessian;
+    dense_t gradient;
+    vector<pair<uint32_t, double>> jacobian;
+    CompensatedSum error;
+};
+
+using normal_equations_t = vector<unique_ptr<NormalEquations>>;
+
+// Adds the entries [begin, end) of the segment to the normal equations and returns their summed squared error.
+// Only the entry's own non-zero derivatives are touched, which fill one triangle of the hessian or the other
+// depending on the coefficient order, so the two triangles are merged after the pass.
+static tune_t add_segment_normal_equations(NormalEquations& equations, const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& params, const tune_t K, const size_t value_count)
+{
+    tune_t error = 0;
+    tune_t compensation = 0;
+    for (uint64_t i = begin; i < end; i++)
+    {
+        const auto& entry = segment.metadata[i];
+        const auto coefficients = segment.get_coefficients(i);
+        const tune_t eval = linear_eval(coefficients, entry, params);
+        const tune_t sig = sigmoid(K, eval);
+        const tune_t diff = entry.wdl - sig;
+        kahan_add(error, compensation, entry.weight * diff * diff);
+
+        // Derivative of the sigmoid with respect to the evaluation
+        const double slope = static_cast<double>(sig) * (1 - sig) * K / 400;
+        auto& jacobian = equations.jacobian;
+        jacobian.clear();
+        for (const auto& coefficient : coefficients)
+        {
+#if TAPERED
+            const auto midgame = slope * coefficient.value * entry.phase / 24;
+            const auto endgame = slope * coefficient.value * entry.endgame_scale * (24 - entry.phase) / 24;
+            if (midgame != 0)
+            {
+                jacobian.emplace_back(coefficient.index * 2 + static_cast<int32_t>(PhaseStages::Midgame), midgame);
+            }
+            if (endgame != 0)
+            {
+                jacobian.emplace_back(coefficient.index * 2 + static_cast<int32_t>(PhaseStages::Endgame), endgame);
+            }
+#else
+            jacobian.emplace_back(coefficient.index, slope * coefficient.value);
+#endif
+        }
+
+        // A merged entry stands for weight identical rows of the jacobian
+        const double weight = entry.weight;
+        for (size_t row = 0; row < jacobian.size(); row++)
+        {
+            const auto [row_index, row_value] = jacobian[row];
+            const auto weighted_value = weight * row_value;
+            equations.gradient[row_index] += weighted_value * diff;
+            auto* hessian_row = equations.hessian.data() + row_index * value_count;
+            for (size_t column = row; column < jacobian.size(); column++)
+            {
+                hessian_row[jacobian[column].first] += weighted_value * jacobian[column].second;
+            }
+        }
+    }
+    return error;
+}
+
+// Accumulates the normal equations of params over all entries into hessian and gradient and returns the average error of params
+static tune_t accumulate_normal_equations(ThreadPool& thread_pool, normal_equations_t& workers, const EntryStore& entries, const parameters_t& params, const tune_t K, dense_t& hessian, dense_t& gradient)
+{
+    const auto value_count = get_value_count(params);
+    thread_pool.parallel_for(0, entries.size(), parallel_grain_size, [&](const uint64_t begin, const uint64_t end, const uint32_t worker_index)
+    {
+        auto& equations = workers[worker_index];
+        if (!equations)
+        {
+            equations = make_unique<NormalEquations>();
+            equations->hessian.resize(value_count * value_count);
+            equations->gradient.resize(value_count);
+        }
+
+        entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+        {
+            kahan_add(equations->error, add_segment_normal_equations(*equations, segment, segment_start, segment_end, params, K, value_count));
+        });
+    });
+
+    // Sums the workers in worker order, one block of rows per job, and clears them for the next pass
+    hessian.assign(value_count * value_count, 0);
+    gradient.assign(value_count, 0);
+    thread_pool.parallel_for(0, value_count, 0, [&](const uint64_t begin, const uint64_t end, const uint32_t)
+    {
+        for (const auto& equations : workers)
+        {
+            if (!equations)
+            {
+                continue;
+            }
+
+            for (auto row = begin; row < end; row++)
+            {
+                gradient[row] += equations->gradient[row];
+                equations->gradient[row] = 0;
+                for (size_t column = 0; column < value_count; column++)
+                {
+                    hessian[row * value_count + column] += equations->hessian[row * value_count + column];
+                    equations->hessian[row * value_count + column] = 0;
+                }
+            }
+        }
+    });
+
+    for (size_t row = 0; row < value_count; row++)
+    {
+        for (auto column = row + 1; column < value_count; column++)
+        {
+            const auto sum = hessian[row * value_count + column] + hessian[column * value_count + row];
+            hessian[row * value_count + column] = sum;
+            hessian[column * value_count + row] = sum;
+        }
+    }
 
-static tune_t find_optimal_k(ThreadPool& thread_pool, const vector<Entry>& entries, const parameters_t& parameters)
+    CompensatedSum total_error;
+    for (auto& equations : workers)
+    {
+        if (equations)
+        {
+            kahan_add(total_error, equations->error.sum);
+            equations->error = CompensatedSum{};
+        }
+    }
+    return to_average_error(entries, total_error.sum);
+}
+
+// Solves (hessian + damping * diag(hessian)) step = gradient with a Cholesky factorization.
+// Values without any coefficients have an empty row and get a unit diagonal, so their step is zero.
+// Returns false if the damped matrix is not positive definite.
+static bool solve_damped_system(const dense_t& hessian, const dense_t& gradient, const double damping, dense_t& factor, vector<double>& step)
 {
-    constexpr tune_t rate = 10;
-    constexpr tune_t delta = 1e-5;
-    constexpr tune_t deviation_goal = 1e-6;
-    tune_t K = 2.5;
-    tune_t deviation = 1;
+    const auto value_count = gradient.size();
+    factor = hessian;
+    for (size_t i = 0; i < value_count; i++)
+    {
+        auto& diagonal = factor[i * value_count + i];
+        diagonal = diagonal == 0 ? 1 : diagonal * (1 + damping);
+    }
 
-    while (fabs(deviation) > deviation_goal)
+    // Lower triangle, row by row, so the inner products run over contiguous memory
+    for (size_t row = 0; row < value_count; row++)
     {
-        const tune_t up = get_average_error(thread_pool, entries, parameters, K + delta);
-        const tune_t down = get_average_error(thread_pool, entries, parameters, K - delta);
-        deviation = (up - down) / (2 * delta);
-        cout << "Current K: " << K << ", up: " << up << ", down: " << down << ", deviation: " << deviation << endl;
-        K -= deviation * rate;
+        auto* row_values = factor.data() + row * value_count;
+        for (size_t column = 0; column <= row; column++)
+        {
+            const auto* column_values = factor.data() + column * value_count;
+            double sum = row_values[column];
+            for (size_t k = 0; k < column; k++)
+            {
+                sum -= row_values[k] * column_values[k];
+            }
+
+            if (column < row)
+            {
+                row_values[column] = sum / column_values[column];
+            }
+            else if (sum > 0)
+            {
+                row_values[row] = sqrt(sum);
+            }
+            else
+            {
+                return false;
+            }
+        }
     }
 
-    return K;
+    step.assign(value_count, 0);
+    for (size_t row = 0; row < value_count; row++)
+    {
+        double sum = gradient[row];
+        for (size_t k = 0; k < row; k++)
+        {
+            sum -= factor[row * value_count + k] * step[k];
+        }
+        step[row] = sum / factor[row * value_count + row];
+    }
+    for (auto row = value_count; row-- > 0;)
+    {
+        double sum = step[row];
+        for (auto k = row + 1; k < value_count; k++)
+        {
+            sum -= factor[k * value_count + row] * step[k];
+        }
+        step[row] = sum / factor[row * value_count + row];
+    }
+    return true;
 }
 
-static void update_single_gradient(parameters_t& gradient, const Entry& entry, const parameters_t& params, tune_t K) {
+// Levenberg-Marquardt on the sigmoid of the linear evaluation. Every iteration takes one pass over the entries to build the
+// normal equations, then tries damped Gauss-Newton steps, each checked with an error pass, until one lowers the error.
+// The damping is lowered after a successful step and raised after a failed one.
+static void run_levenberg_marquardt(ThreadPool& thread_pool, const EntryStore& entries, TuningRun& run, const high_resolution_clock::time_point start)
+{
+    auto& parameters = run.parameters;
+    const auto K = run.K;
+    constexpr double max_damping = 1e10;
+    constexpr double min_damping = 1e-12;
+    constexpr double damping_factor = 10;
+
+    normal_equations_t workers(thread_pool.thread_count());
+    dense_t hessian;
+    dense_t gradient;
+    dense_t factor;
+    vector<double> step;
+    auto trial_parameters = parameters;
+    double damping = lm_initial_damping;
+
+    tune_t error = accumulate_normal_equations(thread_pool, workers, entries, parameters, K, hessian, gradient);
+    for (int32_t iteration = 1; iteration <= lm_max_iterations; iteration++)
+    {
+        tune_t trial_error = error;
+        while (damping <= max_damping)
+        {
+            if (!solve_damped_system(hessian, gradient, damping, factor, step))
+            {
+                damping *= damping_factor;
+                continue;
+            }
+
+            const auto* values = reinterpret_cast<const tune_t*>(parameters.data());
+            auto* trial_values = reinterpret_cast<tune_t*>(trial_parameters.data());
+            for (size_t i = 0; i < step.size(); i++)
+            {
+                trial_values[i] = static_cast<tune_t>(values[i] + step[i]);
+            }
 
-    const tune_t eval = linear_eval(entry, params);
-    const tune_t sig = sigmoid(K, eval);
-    const tune_t res = (entry.wdl - sig) * sig * (1 - sig);
+            trial_error = get_average_error(thread_pool, entries, trial_parameters, K);
+            if (trial_error < error)
+            {
+                break;
+            }
+            damping *= damping_factor;
+        }
 
-#if TAPERED
-    const auto mg_base = res * (entry.phase / static_cast<tune_t>(24));
-    const auto eg_base = res - mg_base;
-#endif
+        if (damping > max_damping)
+        {
+            print_elapsed(start);
+            cout << "Iteration " << iteration << ", no step lowers the error, stopping" << endl;
+            break;
+        }
+
+        const auto improvement = (error - trial_error) / error;
+        parameters.swap(trial_parameters);
+        damping = max(damping / damping_factor, min_damping);
+        run.epochs = iteration;
+
+        print_elapsed(start);
+        cout << "Iteration " << iteration << ", error " << trial_error << ", damping " << damping << endl;
+
+        if (improvement < lm_tolerance || iteration == lm_max_iterations)
+        {
+            error = trial_error;
+            break;
+        }
+        error = accumulate_normal_equations(thread_pool, workers, entries, parameters, K, hessian, gradient);
+    }
+
+    run.error = error;
+}
 
-    for (const auto& coefficient : entry.coefficients)
+// Sums the workers' gradients in worker order into gradient, scaled to the derivative of the average error, and clears them
+static void reduce_gradient(ThreadPool& thread_pool, accumulators_t& accumulators, vector<double>& gradient, const tune_t K, const uint64_t entry_count)
+{
+    const auto scale = -2.0 * K / 400 / static_cast<double>(entry_count);
+    for_each_value_chunk(thread_pool, gradient.size(), [&](const uint64_t begin, const uint64_t end, const uint32_t)
     {
-#if TAPERED
-        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Midgame)] += mg_base * coefficient.value;
-        gradient[coefficient.index][static_cast<int32_t>(PhaseStages::Endgame)] += eg_base * coefficient.value * entry.endgame_scale;
-#else
-        gradient[coefficient.index] += res * coefficient.value;
-#endif
+        for (auto value_index = begin; value_index < end; value_index++)
+        {
+            gradient[value_index] = scale * take_gradient_value(accumulators, value_index);
+        }
+    });
+}
+
+using step_lengths_t = array<double, lbfgs_line_search_steps>;
+using step_errors_t = array<CompensatedSum, lbfgs_line_search_steps>;
+
+// Adds the squared error of each entry in [begin, end) at params + step_lengths[i] * direction to errors[i].
+// The evaluation is linear, so every step length only needs the entry's evaluation of params and of the direction.
+static void add_segment_step_errors(step_errors_t& errors, const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& params, const parameters_t& direction, const step_lengths_t& step_lengths, const tune_t K)
+{
+    for (uint64_t i = begin; i < end; i++)
+    {
+        const auto& entry = segment.metadata[i];
+        const auto coefficients = segment.get_coefficients(i);
+        const tune_t eval = linear_eval(coefficients, entry, params);
+        const tune_t eval_change = linear_eval(coefficients, entry, direction, 0);
+        for (size_t step = 0; step < step_lengths.size(); step++)
+        {
+            const tune_t diff = entry.wdl - sigmoid(K, eval + static_cast<tune_t>(step_lengths[step]) * eval_change);
+            kahan_add(errors[step], entry.weight * diff * diff);
+        }
+    }
+}
+
+// Returns the average error at every step length along direction, from a single pass over the entries
+static array<double, lbfgs_line_search_steps> get_step_errors(ThreadPool& thread_pool, const EntryStore& entries, const parameters_t& params, const parameters_t& direction, const step_lengths_t& step_lengths, const tune_t K)
+{
+    const auto total_errors = thread_pool.parallel_reduce(0, entries.size(), parallel_grain_size, step_errors_t{},
+        [&](const uint64_t begin, const uint64_t end, step_errors_t& errors)
+        {
+            entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+            {
+                add_segment_step_errors(errors, segment, segment_start, segment_end, params, direction, step_lengths, K);
+            });
+        },
+        [](step_errors_t& total, const step_errors_t& partial)
+        {
+            for (size_t step = 0; step < total.size(); step++)
+            {
+                kahan_add(total[step], partial[step].sum);
+            }
+        });
+
+    array<double, lbfgs_line_search_steps> errors;
+    for (size_t step = 0; step < errors.size(); step++)
+    {
+        errors[step] = (total_errors[step].sum + entries.duplicate_error()) / static_cast<double>(entries.total_weight());
     }
+    return errors;
 }
 
-static void compute_gradient(ThreadPool& thread_pool, parameters_t& gradient, const vector<Entry>& entries, const parameters_t& params, tune_t K)
+// Adds the diagonal of the Gauss-Newton Hessian of entries [begin, end) of the segment, the sum of the squared derivatives
+// of the sigmoid with respect to each value
+static void add_segment_hessian_diagonal(vector<double>& diagonal, const DataSegment& segment, const uint64_t begin, const uint64_t end, const parameters_t& params, const tune_t K)
 {
-    array<parameters_t, thread_count> thread_gradients;
-    for(int thread_id = 0; thread_id < thread_count; thread_id++)
+    for (uint64_t i = begin; i < end; i++)
     {
-        thread_pool.enqueue([thread_id, &thread_gradients, &entries, &params, K]()
+        const auto& entry = segment.metadata[i];
+        const auto coefficients = segment.get_coefficients(i);
+        const tune_t sig = sigmoid(K, linear_eval(coefficients, entry, params));
+        const double slope = static_cast<double>(sig) * (1 - sig) * K / 400;
+        const double weight = entry.weight;
+        for (const auto& coefficient : coefficients)
         {
-            const auto entries_per_thread = entries.size() / thread_count;
-            const auto start = static_cast<int>(thread_id * entries_per_thread);
-            const auto end = static_cast<int>((thread_id + 1) * entries_per_thread - 1);
 #if TAPERED
-            parameters_t gradient = parameters_t(params.size(), pair_t{});
+            const auto midgame = slope * coefficient.value * entry.phase / 24;
+            const auto endgame = slope * coefficient.value * entry.endgame_scale * (24 - entry.phase) / 24;
+            diagonal[coefficient.index * 2 + static_cast<int32_t>(PhaseStages::Midgame)] += weight * midgame * midgame;
+            diagonal[coefficient.index * 2 + static_cast<int32_t>(PhaseStages::Endgame)] += weight * endgame * endgame;
 #else
-            parameters_t gradient = parameters_t(params.size(), 0);
+            diagonal[coefficient.index] += weight * slope * slope * coefficient.value * coefficient.value;
 #endif
-            for (int i = start; i < end; i++)
+        }
+    }
+}
+
+// Returns the inverse of the Gauss-Newton Hessian diagonal of params, 1 for values without any coefficients
+static vector<double> get_inverse_hessian_diagonal(ThreadPool& thread_pool, const EntryStore& entries, const parameters_t& params, const tune_t K)
+{
+    const auto value_count = get_value_count(params);
+    auto diagonal = thread_pool.parallel_reduce(0, entries.size(), parallel_grain_size, vector<double>(value_count),
+        [&](const uint64_t begin, const uint64_t end, vector<double>& partial)
+        {
+            entries.for_each_range(begin, end, [&](const DataSegment& segment, const uint64_t segment_start, const uint64_t segment_end)
+            {
+                add_segment_hessian_diagonal(partial, segment, segment_start, segment_end, params, K);
+            });
+        },
+        [](vector<double>& total, const vector<double>& partial)
+        {
+            for (size_t value = 0; value < total.size(); value++)
             {
-                const auto& entry = entries[i];
-                update_single_gradient(gradient, entry, params, K);
+                total[value] += partial[value];
             }
-            thread_gradients[thread_id] = gradient;
         });
+
+    for (auto& value : diagonal)
+    {
+        value = value > 0 ? 1 / value : 1;
     }
+    return diagonal;
+}
 
-    thread_pool.wait_for_completion();
+static double dot(const vector<double>& a, const vector<double>& b)
+{
+    double sum = 0;
+    for (size_t i = 0; i < a.size(); i++)
+    {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// Parameter and gradient differences of the most recent L-BFGS steps, oldest first
+struct LbfgsHistory
+{
+    deque<vector<double>> parameter_changes;
+    deque<vector<double>> gradient_changes;
+    deque<double> curvatures;
 
-    for (int thread_id = 0; thread_id < thread_count; thread_id++)
+    void add(vector<double>&& parameter_change, vector<double>&& gradient_change)
     {
-        for(auto parameter_index = 0; parameter_index < params.size(); parameter_index++)
+        const auto curvature = dot(parameter_change, gradient_change);
+        if (curvature <= 0)
         {
-#if TAPERED
-            gradient[parameter_index][static_cast<int32_t>(PhaseStages::Midgame)] += thread_gradients[thread_id][parameter_index][static_cast<int32_t>(PhaseStages::Midgame)];
-            gradient[parameter_index][static_cast<int32_t>(PhaseStages::Endgame)] += thread_gradients[thread_id][parameter_index][static_cast<int32_t>(PhaseStages::Endgame)];
-#else
-            gradient[parameter_index] += thread_gradients[thread_id][parameter_index];
-#endif
+            return;
+        }
+
+        if (parameter_changes.size() == lbfgs_history_size)
+        {
+            parameter_changes.pop_front();
+            gradient_changes.pop_front();
+            curvatures.pop_front();
+        }
+        parameter_changes.push_back(std::move(parameter_change));
+        gradient_changes.push_back(std::move(gradient_change));
+        curvatures.push_back(curvature);
+    }
+
+    void clear()
+    {
+        parameter_changes.clear();
+        gradient_changes.clear();
+        curvatures.clear();
+    }
+
+    // Two-loop recursion, returns the approximate inverse Hessian times gradient. The initial approximation is the
+    // diagonal preconditioner, scaled by the curvature of the most recent step.
+    vector<double> apply_inverse_hessian(const vector<double>& gradient, const vector<double>& preconditioner) const
+    {
+        auto result = gradient;
+        vector<double> alphas(curvatures.size());
+        for (auto i = curvatures.size(); i-- > 0;)
+        {
+            alphas[i] = dot(parameter_changes[i], result) / curvatures[i];
+            for (size_t value = 0; value < result.size(); value++)
+            {
+                result[value] -= alphas[i] * gradient_changes[i][value];
+            }
+        }
+
+        double scale = 1;
+        if (!curvatures.empty())
+        {
+            const auto& gradient_change = gradient_changes.back();
+            double weighted_norm = 0;
+            for (size_t value = 0; value < gradient_change.size(); value++)
+            {
+                weighted_norm += gradient_change[value] * gradient_change[value] * preconditioner[value];
+            }
+            scale = curvatures.back() / weighted_norm;
+        }
+        for (size_t value = 0; value < result.size(); value++)
+        {
+            result[value] *= scale * preconditioner[value];
+        }
+
+        for (size_t i = 0; i < curvatures.size(); i++)
+        {
+            const auto beta = dot(gradient_changes[i], result) / curvatures[i];
+            for (size_t value = 0; value < result.size(); value++)
+            {
+                result[value] += (alphas[i] - beta) * parameter_changes[i][value];
+            }
+        }
+        return result;
+    }
+};
+
+// L-BFGS on the full-batch error. Each iteration takes one gradient pass and usually a single line search pass, which
+// evaluates lbfgs_line_search_steps step lengths at once, and moves to the lowest error that satisfies the Armijo condition.
+static void run_lbfgs(ThreadPool& thread_pool, const EntryStore& entries, TuningRun& run, const high_resolution_clock::time_point start)
+{
+    auto& parameters = run.parameters;
+    const auto K = run.K;
+    constexpr double armijo_factor = 1e-4;
+    constexpr double step_ratio = 2;
+    constexpr int32_t max_search_passes = 10;
+
+    const auto value_count = get_value_count(parameters);
+    accumulators_t accumulators(thread_pool.thread_count());
+    vector<double> gradient(value_count);
+    vector<double> new_gradient(value_count);
+    parameters_t direction(parameters.size());
+    LbfgsHistory history;
+    const auto preconditioner = get_inverse_hessian_diagonal(thread_pool, entries, parameters, K);
+    int32_t pass_count = 2;
+
+    double error = accumulate_gradient(thread_pool, accumulators, entries, parameters, K);
+    reduce_gradient(thread_pool, accumulators, gradient, K, entries.total_weight());
+    for (int32_t iteration = 1; iteration <= lbfgs_max_iterations; iteration++)
+    {
+        auto search_direction = history.apply_inverse_hessian(gradient, preconditioner);
+        auto slope = -dot(gradient, search_direction);
+        if (slope >= 0)
+        {
+            history.clear();
+            search_direction = history.apply_inverse_hessian(gradient, preconditioner);
+            slope = -dot(gradient, search_direction);
+        }
+
+        // With the diagonal preconditioner even the first step is a Gauss-Newton step, so its length is close to 1
+        double center_step = 1;
+        auto* direction_values = reinterpret_cast<tune_t*>(direction.data());
+        for (size_t value = 0; value < value_count; value++)
+        {
+            direction_values[value] = static_cast<tune_t>(-search_direction[value]);
+        }
+
+        // Step lengths from center_step * step_ratio^2 down, searching further out while the longest step is the best
+        double accepted_step = 0;
+        double accepted_error = error;
+        for (int32_t search_pass = 0; search_pass < max_search_passes; search_pass++)
+        {
+            step_lengths_t step_lengths;
+            for (size_t step = 0; step < step_lengths.size(); step++)
+            {
+                step_lengths[step] = center_step * pow(step_ratio, 2 - static_cast<double>(step));
+            }
+
+            const auto errors = get_step_errors(thread_pool, entries, parameters, direction, step_lengths, K);
+            pass_count++;
+            for (size_t step = 0; step < step_lengths.size(); step++)
+            {
+                if (errors[step] < accepted_error && errors[step] <= error + armijo_factor * step_lengths[step] * slope)
+                {
+                    accepted_step = step_lengths[step];
+                    accepted_error = errors[step];
+                }
+            }
+
+            if (accepted_step == step_lengths.front())
+            {
+                center_step *= pow(step_ratio, static_cast<double>(step_lengths.size() - 1));
+            }
+            else if (accepted_step == 0)
+            {
+                center_step /= pow(step_ratio, static_cast<double>(step_lengths.size()));
+            }
+            else
+            {
+                break;
+            }
+        }
+
+        if (accepted_step == 0)
+        {
+            print_elapsed(start);
+            cout << "Iteration " << iteration << ", no step lowers the error, stopping" << endl;
+            break;
+        }
+
+        auto* values = reinterpret_cast<tune_t*>(parameters.data());
+        vector<double> parameter_change(value_count);
+        for (size_t value = 0; value < value_count; value++)
+        {
+            const auto old_value = values[value];
+            values[value] = static_cast<tune_t>(values[value] + accepted_step * direction_values[value]);
+            parameter_change[value] = values[value] - old_value;
+        }
+
+        const double new_error = accumulate_gradient(thread_pool, accumulators, entries, parameters, K);
+        reduce_gradient(thread_pool, accumulators, new_gradient, K, entries.total_weight());
+        pass_count++;
+
+        vector<double> gradient_change(value_count);
+        for (size_t value = 0; value < value_count; value++)
+        {
+            gradient_change[value] = new_gradient[value] - gradient[value];
+        }
+        history.add(std::move(parameter_change), std::move(gradient_change));
+        gradient.swap(new_gradient);
+
+        print_elapsed(start);
+        cout << "Iteration " << iteration << ", error " << new_error << ", step " << accepted_step << ", " << pass_count << " passes" << endl;
+
+        const auto improvement = (error - new_error) / error;
+        error = new_error;
+        run.epochs = iteration;
+        if (improvement < lbfgs_tolerance)
+        {
+            break;
+        }
+    }
+
+    run.error = static_cast<tune_t>(error);
+}
+
+// Throws unless the checkpoint was written for the same dataset, parameters and runs. Only max_epoch may change, to extend a finished run.
+static void check_checkpoint(const Checkpoint& checkpoint, const EntryStore& entries, const parameters_t& parameters, const vector<RunConfig>& run_configs, const uint32_t share_count)
+{
+    if (checkpoint.entry_count != entries.size() || checkpoint.total_weight != entries.total_weight())
+    {
+        throw runtime_error(string("Checkpoint ") + checkpoint_path + " was written for a different dataset, delete it to start over");
+    }
+    if (checkpoint.runs.size() != run_configs.size())
+    {
+        throw runtime_error(string("Checkpoint ") + checkpoint_path + " has " + to_string(checkpoint.runs.size()) + " runs instead of " + to_string(run_configs.size()) + ", delete it to start over");
+    }
+
+    for (size_t run_index = 0; run_index < run_configs.size(); run_index++)
+    {
+        const auto& saved = checkpoint.runs[run_index];
+        const auto& config = run_configs[run_index];
+        if (saved.parameters.size() != parameters.size())
+        {
+            throw runtime_error(string("Checkpoint ") + checkpoint_path + " was written for a different evaluation, delete it to start over");
+        }
+        if (saved.config.name != config.name || saved.config.initial_learning_rate != config.initial_learning_rate
+            || saved.config.learning_rate_drop_interval != config.learning_rate_drop_interval || saved.config.learning_rate_drop_ratio != config.learning_rate_drop_ratio
+            || saved.config.preferred_k != config.preferred_k)
+        {
+            throw runtime_error(string("Checkpoint ") + checkpoint_path + " was written with different settings for run " + config.name + ", delete it to start over");
         }
     }
+
+    // Tuning can continue with other mini-batch settings, it just no longer matches an uninterrupted run
+    if (checkpoint.batch_size != batch_size
+        || (batch_size > 0 && (checkpoint.shuffle_seed != shuffle_seed || checkpoint.shuffle_share_count != share_count)))
+    {
+        cout << "Checkpoint " << checkpoint_path << " was written with a different batch_size, shuffle_seed or thread_count, the batches after resuming differ from an uninterrupted run" << endl;
+    }
 }
 
-void Tuner::run(const std::vector<DataSource>& sources)
+void Tuner::run(const std::vector<DataSource>& sources, const std::vector<RunConfig>& run_configs)
 {
     cout << "Starting tuning" << endl << endl;
     const auto start = high_resolution_clock::now();
 
     cout << "Starting thread pool..." << endl;
     ThreadPool thread_pool;
-    thread_pool.start(thread_count);
+    thread_pool.start(thread_count, enable_numa);
 
     cout << "Getting initial parameters..." << endl;
     auto parameters = TuneEval::get_initial_parameters();
@@ -823,7 +2676,7 @@ void Tuner::run(const std::vector<DataSource>& sources)
     cout << "Initial parameters:" << endl;
     TuneEval::print_parameters(parameters);
 
-    vector<Entry> entries;
+    EntryStore entries;
 
     // Debug entry
     //const string debug_fen = "rnb1kbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQK1NR w KQkq - 0 1; 1.0";
@@ -834,14 +2687,26 @@ void Tuner::run(const std::vector<DataSource>& sources)
     //debug_entry.initial_eval = linear_eval(debug_entry, parameters);
     //entries.push_back(debug_entry);
 
-    vector<string> fens;
-    for (const auto& source : sources)
+    load_sources(thread_pool, sources, parameters, start, entries);
+    cout << "Data loading complete" << endl << endl;
+
+    if constexpr (deduplicate_entries)
     {
-        load_fens(thread_pool, source, parameters, start, entries);
+        cout << "Deduplicating entries..." << endl;
+        const auto removed_count = entries.deduplicate(thread_pool);
+        print_elapsed(start);
+        cout << "Merged " << removed_count << " duplicate positions, " << entries.size() << " entries remain" << endl << endl;
+    }
+
+    if constexpr (enable_numa)
+    {
+        entries.localize(thread_pool);
+        print_elapsed(start);
+        cout << "Copied entries to " << entries.get_segments().size() << " worker-local segments" << endl << endl;
     }
-    cout << "Data loading complete" << endl << endl;
 
     print_statistics(parameters, entries);
+    select_kernel(entries, parameters);
 
     if constexpr (retune_from_zero)
     {
@@ -859,78 +2724,116 @@ void Tuner::run(const std::vector<DataSource>& sources)
     cout << "Initial parameters:" << endl;
     TuneEval::print_parameters(parameters);
 
-    tune_t K;
-    if constexpr (preferred_k <= 0)
+    Checkpoint checkpoint;
+    bool resumed = false;
+    if constexpr (checkpoint_interval > 0)
+    {
+        if constexpr (optimizer == OptimizerType::Adam)
+        {
+            resumed = load_checkpoint(checkpoint_path, checkpoint);
+        }
+        else
+        {
+            cout << "Checkpoints are only written by Adam" << endl;
+        }
+    }
+
+    vector<TuningRun> runs;
+    if (resumed)
     {
-        cout << "Finding optimal K..." << endl;
-        K = find_optimal_k(thread_pool, entries, parameters);
+        check_checkpoint(checkpoint, entries, parameters, run_configs, thread_pool.thread_count());
+        print_elapsed(start);
+        cout << "Resuming from checkpoint " << checkpoint_path << " after epoch " << checkpoint.epoch << endl;
+        for (size_t run_index = 0; run_index < run_configs.size(); run_index++)
+        {
+            const auto& saved = checkpoint.runs[run_index];
+            runs.push_back(TuningRun{ run_configs[run_index], saved.K, saved.parameters, saved.initial_error, saved.error, saved.epochs });
+            if (run_configs.size() > 1)
+            {
+                cout << "Run " << saved.config.name << ": ";
+            }
+            cout << "K = " << saved.K << ", error " << saved.error << endl;
+        }
     }
     else
     {
-        cout << "Using predefined K = " << preferred_k <<  endl;
-        K = preferred_k;
+        tune_t optimal_k = 0;
+        for (const auto& config : run_configs)
+        {
+            TuningRun run{ config, static_cast<tune_t>(config.preferred_k), parameters };
+            if (run.K <= 0)
+            {
+                if (optimal_k <= 0)
+                {
+                    cout << "Finding optimal K..." << endl;
+                    optimal_k = find_optimal_k(thread_pool, entries, parameters);
+                }
+                run.K = optimal_k;
+            }
+            run.initial_error = get_average_error(thread_pool, entries, parameters, run.K);
+            run.error = run.initial_error;
+            if (run_configs.size() > 1)
+            {
+                cout << "Run " << run.config.name << ": ";
+            }
+            cout << "K = " << run.K << endl;
+            cout << "Initial error = " << run.initial_error << endl;
+            runs.push_back(run);
+        }
     }
-    cout << "K = " << K << endl;
 
-    const auto avg_error = get_average_error(thread_pool, entries, parameters, K);
-    cout << "Initial error = " << avg_error << endl;
-
-    const auto loop_start = high_resolution_clock::now();
-    tune_t learning_rate = initial_learning_rate;
-    int32_t max_tune_epoch = max_epoch;
-#if TAPERED
-    parameters_t momentum(parameters.size(), pair_t{});
-    parameters_t velocity(parameters.size(), pair_t{});
-#else
-    parameters_t momentum(parameters.size(), 0);
-    parameters_t velocity(parameters.size(), 0);
-#endif
-    for (int32_t epoch = 1; epoch < max_tune_epoch; epoch++)
+    if constexpr (optimizer == OptimizerType::Adam)
     {
-#if TAPERED
-        parameters_t gradient(parameters.size(), pair_t{});
-#else
-        parameters_t gradient(parameters.size(), 0);
-#endif
-        
-        compute_gradient(thread_pool, gradient, entries, parameters, K);
-
-        constexpr tune_t beta1 = 0.9;
-        constexpr tune_t beta2 = 0.999;
-
-        for (int parameter_index = 0; parameter_index < parameters.size(); parameter_index++) {
-#if TAPERED
-            for(int phase_stage = 0; phase_stage < 2; phase_stage++)
+        run_adam(thread_pool, entries, runs, resumed ? &checkpoint : nullptr, start);
+    }
+    else
+    {
+        for (auto& run : runs)
+        {
+            if (runs.size() > 1)
             {
-                const tune_t grad = -K / static_cast<tune_t>(400) * gradient[parameter_index][phase_stage] / static_cast<tune_t>(entries.size());
-                momentum[parameter_index][phase_stage] = beta1 * momentum[parameter_index][phase_stage] + (1 - beta1) * grad;
-                velocity[parameter_index][phase_stage] = beta2 * velocity[parameter_index][phase_stage] + (1 - beta2) * pow(grad, 2);
-                parameters[parameter_index][phase_stage] -= learning_rate * momentum[parameter_index][phase_stage] / (static_cast<tune_t>(1e-8) + sqrt(velocity[parameter_index][phase_stage]));
+                cout << endl << "Run " << run.config.name << endl;
+            }
+            if constexpr (optimizer == OptimizerType::LevenbergMarquardt)
+            {
+                run_levenberg_marquardt(thread_pool, entries, run, start);
+            }
+            else
+            {
+                run_lbfgs(thread_pool, entries, run, start);
             }
-#else
-            const tune_t grad = -K / 400.0 * gradient[parameter_index] / static_cast<tune_t>(entries.size());
-            momentum[parameter_index] = beta1 * momentum[parameter_index] + (1 - beta1) * grad;
-            velocity[parameter_index] = beta2 * velocity[parameter_index] + (1 - beta2) * pow(grad, 2);
-            parameters[parameter_index] -= learning_rate * momentum[parameter_index] / (1e-8 + sqrt(velocity[parameter_index]));
-#endif
-            
         }
+    }
+    thread_pool.stop();
 
-        if (epoch % 100 == 0)
+    if (runs.size() == 1)
+    {
+        if constexpr (optimizer != OptimizerType::Adam)
         {
-            const auto elapsed_ms = duration_cast<milliseconds>(high_resolution_clock::now() - loop_start).count();
-            const auto epochs_per_second = epoch * 1000.0 / elapsed_ms;
-            const tune_t error = get_average_error(thread_pool, entries, parameters, K);
-            print_elapsed(start);
-            cout << "Epoch " << epoch << " (" << epochs_per_second << " eps), error " << error << ", LR " << learning_rate << endl;
-            TuneEval::print_parameters(parameters);
+            TuneEval::print_parameters(runs[0].parameters);
         }
+        return;
+    }
 
-        if(epoch % learning_rate_drop_interval == 0)
+    print_elapsed(start);
+    cout << "Sweep results:" << endl;
+    cout << "name, initial_learning_rate, learning_rate_drop_interval, learning_rate_drop_ratio, K, epochs, initial error, final error" << endl;
+    const TuningRun* best_run = &runs[0];
+    for (const auto& run : runs)
+    {
+        cout << run.config.name << ", " << run.config.initial_learning_rate << ", " << run.config.learning_rate_drop_interval << ", " << run.config.learning_rate_drop_ratio;
+        cout << ", " << run.K << ", " << run.epochs << ", " << run.initial_error << ", " << run.error << endl;
+        if (run.error < best_run->error)
         {
-            learning_rate *= learning_rate_drop_ratio;
+            best_run = &run;
         }
     }
 
-    thread_pool.stop();
+    cout << endl << "Best run: " << best_run->config.name << endl;
+    TuneEval::print_parameters(best_run->parameters);
+}
+
+RunConfig Tuner::get_default_run_config()
+{
+    return RunConfig{ "default", initial_learning_rate, learning_rate_drop_interval, learning_rate_drop_ratio, preferred_k, max_epoch };
 }
@@ -14,7 +14,25 @@ namespace Tuner
         int64_t position_limit;
     };
 
-    void run(const std::vector<DataSource>& sources);
+    // Settings of a single tuning run, defaults come from config.h
+    struct RunConfig
+    {
+        std::string name;
+        double initial_learning_rate;
+        int32_t learning_rate_drop_interval;
+        double learning_rate_drop_ratio;
+        double preferred_k;
+        int32_t max_epoch;
+    };
+
+    RunConfig get_default_run_config();
+
+    // Loads the data sources once and tunes every run on them. With several runs, a comparison is printed at the end.
+    void run(const std::vector<DataSource>& sources, const std::vector<RunConfig>& run_configs);
+
+    // Compares the sparse trace of the evaluation with its dense coefficients on positions from random playouts.
+    // Prints the first mismatching FENs and returns whether all positions matched.
+    bool check_traces(int64_t position_count, uint64_t seed);
 }
 
 #endif // !TUNER_H